@@ -0,0 +1,328 @@
+// blockwriter.h : Buffered output file flushed from a background thread.
+//
+// Output is formatted straight into one of two large buffers. When a buffer fills up, it is handed to the
+// writer's own thread, which writes it with pwrite at its offset while the other buffer is being filled; the
+// formatting side only waits if it fills its buffer before the previous one is on disk. Bytes already written can
+// be patched in place with writeAt (e.g. a header whose counts are only known at the end).
+//
+// ShardedWriter instead has several threads format and write whole byte ranges of the file at once: ranges are
+// reserved in file order by the one producer, which knows their sizes up front, and each is then filled and written
+// with pwrite by whichever writer thread takes it, so no single thread copies every byte of the output.
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+using OutputHandle = HANDLE;
+#else
+using OutputHandle = int;
+#endif
+
+// Writes all len bytes at offset, going on after short (and on POSIX, interrupted) writes; false if a write failed
+inline bool writeAllAt(const OutputHandle file, const char* data, size_t len, uint64_t offset) {
+	while (len) {
+#ifdef _WIN32
+		OVERLAPPED at = {};
+		at.Offset = (DWORD)offset;
+		at.OffsetHigh = (DWORD)(offset >> 32);
+		DWORD done = 0;
+		if (!WriteFile(file, data, (DWORD)std::min<size_t>(len, 1u << 30), &done, &at)) return false;
+#else
+		const ssize_t done = pwrite(file, data, len, (off_t)offset);
+		if (done < 0 && errno == EINTR) continue;
+		if (done <= 0) return false;
+#endif
+		data += done;
+		len -= (size_t)done;
+		offset += (uint64_t)done;
+	}
+	return true;
+}
+
+class BlockWriter {
+public:
+	static constexpr size_t defaultBlockSize = 8388608; // 8 mb
+
+	BlockWriter() = default;
+	BlockWriter(const BlockWriter&) = delete;
+	BlockWriter& operator=(const BlockWriter&) = delete;
+	~BlockWriter() { close(); }
+
+	// Creates (or truncates) the file and starts the flushing thread; false if the file could not be created
+	bool open(const std::filesystem::path& path, const size_t blockSize = defaultBlockSize) {
+		close();
+#ifdef _WIN32
+		file = CreateFileW(path.wstring().c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) return false;
+#else
+		file = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (file < 0) return false;
+#endif
+		capacity = blockSize;
+		for (auto& buffer : buffers) buffer.reset(new char[capacity]);
+		current = 0;
+		fill = 0;
+		flushed = 0;
+		failed = false;
+		stopping = false;
+		pending = false;
+		flusher = std::thread([this]() { _flushLoop(); });
+		return true;
+	}
+
+	void write(const char* data, size_t len) {
+		while (len) {
+			const size_t part = std::min(len, capacity - fill);
+			std::memcpy(buffers[current].get() + fill, data, part);
+			fill += part;
+			data += part;
+			len -= part;
+			if (fill == capacity) _submit();
+		}
+	}
+
+	void write(std::string_view text) { write(text.data(), text.size()); }
+
+	void put(const char c) {
+		buffers[current][fill++] = c;
+		if (fill == capacity) _submit();
+	}
+
+	// Number of bytes written so far
+	uint64_t position() const { return flushed + fill; }
+
+	// Overwrites bytes at offset, which must already have been written; waits for everything before to be on disk
+	bool writeAt(const uint64_t offset, const char* data, const size_t len) {
+		_submit();
+		_wait();
+		if (!writeAllAt(file, data, len, offset)) failed = true;
+		return !failed;
+	}
+
+	// Writes what is left, stops the flushing thread and closes the file; false if any write failed
+	bool close() {
+		if (!flusher.joinable()) return !failed;
+		_submit();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		flusher.join();
+#ifdef _WIN32
+		if (!CloseHandle(file)) failed = true;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (::close(file) != 0) failed = true;
+		file = -1;
+#endif
+		return !failed;
+	}
+
+	bool good() const { return !failed; }
+
+private:
+	// Hands the current buffer to the flushing thread (once it is done with the other one) and switches buffers
+	void _submit() {
+		if (!fill) return;
+		_wait();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = { buffers[current].get(), fill, flushed };
+			pending = true;
+		}
+		wake.notify_all();
+		flushed += fill;
+		fill = 0;
+		current ^= 1;
+	}
+
+	void _wait() {
+		std::unique_lock<std::mutex> lock(mutex);
+		wake.wait(lock, [this] { return !pending; });
+	}
+
+	void _flushLoop() {
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			wake.wait(lock, [this] { return pending || stopping; });
+			if (!pending) return;
+			const Job next = job;
+			lock.unlock();
+			const bool written = writeAllAt(file, next.data, next.len, next.offset);
+			lock.lock();
+			if (!written) failed = true;
+			pending = false;
+			wake.notify_all();
+		}
+	}
+
+	struct Job {
+		const char* data = nullptr;
+		size_t len = 0;
+		uint64_t offset = 0;
+	};
+
+	std::unique_ptr<char[]> buffers[2];
+	size_t capacity = 0;
+	int current = 0;
+	size_t fill = 0; // bytes in the current buffer
+	uint64_t flushed = 0; // bytes handed to the flushing thread
+	std::thread flusher;
+	std::mutex mutex;
+	std::condition_variable wake;
+	Job job;
+	bool pending = false;
+	bool stopping = false;
+	std::atomic<bool> failed{ false };
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+#else
+	int file = -1;
+#endif
+};
+
+class ShardedWriter {
+public:
+	static constexpr uint64_t preallocateChunk = 268435456; // 256 mb
+
+	ShardedWriter() = default;
+	ShardedWriter(const ShardedWriter&) = delete;
+	ShardedWriter& operator=(const ShardedWriter&) = delete;
+	~ShardedWriter() { close(); }
+
+	// Creates (or truncates) the file and starts `threads` writer threads; at most maxPending ranges wait for a thread
+	bool open(const std::filesystem::path& path, const unsigned int threads, const size_t maxPending) {
+		close();
+#ifdef _WIN32
+		file = CreateFileW(path.wstring().c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) return false;
+#else
+		file = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (file < 0) return false;
+#endif
+		reserved = 0;
+		allocated = 0;
+		pendingLimit = std::max<size_t>(1, maxPending);
+		failed = false;
+		stopping = false;
+		for (unsigned int t = 0; t < std::max(1u, threads); ++t) pool.emplace_back([this]() { _work(); });
+		return true;
+	}
+
+	// Reserves the next len bytes of the file and returns their offset. Space is preallocated ahead in large
+	// chunks, so that ranges written out of order do not leave the file fragmented.
+	uint64_t reserve(const uint64_t len) {
+		const uint64_t offset = reserved;
+		reserved += len;
+#ifdef __linux__
+		if (reserved > allocated) {
+			const uint64_t upto = reserved + preallocateChunk;
+			if (fallocate(file, FALLOC_FL_KEEP_SIZE, (off_t)allocated, (off_t)(upto - allocated)) == 0) allocated = upto;
+			else allocated = UINT64_MAX; // not supported by the file system: just write
+		}
+#endif
+		return offset;
+	}
+
+	// Has a writer thread call fill(buffer) and write the buffer at offset; waits while too many ranges are pending
+	void submit(const uint64_t offset, std::function<void(std::string&)> fill) {
+		std::unique_lock<std::mutex> lock(mutex);
+		wake.wait(lock, [this] { return jobs.size() < pendingLimit; });
+		jobs.push_back({ offset, std::move(fill) });
+		wake.notify_all();
+	}
+
+	// Writes data at offset straight away, from the calling thread
+	bool writeAt(const uint64_t offset, const char* data, const size_t len) {
+		if (!writeAllAt(file, data, len, offset)) failed = true;
+		return !failed;
+	}
+
+	// Waits for all ranges to be written, trims the preallocation and closes the file; false if any write failed
+	bool close() {
+		if (pool.empty()) return !failed;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& thread : pool) thread.join();
+		pool.clear();
+#ifdef _WIN32
+		if (!CloseHandle(file)) failed = true;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (ftruncate(file, (off_t)reserved) != 0) failed = true; // drop blocks preallocated past the end
+		if (::close(file) != 0) failed = true;
+		file = -1;
+#endif
+		return !failed;
+	}
+
+private:
+	struct Job {
+		uint64_t offset;
+		std::function<void(std::string&)> fill;
+	};
+
+	void _work() {
+		std::string buffer;
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			wake.wait(lock, [this] { return !jobs.empty() || stopping; });
+			if (jobs.empty()) return;
+			Job job = std::move(jobs.front());
+			jobs.pop_front();
+			wake.notify_all();
+			lock.unlock();
+			buffer.clear();
+			job.fill(buffer);
+			if (!writeAllAt(file, buffer.data(), buffer.size(), job.offset)) failed = true;
+			job.fill = nullptr; // let go of what the range was formatted from before waiting again
+			lock.lock();
+		}
+	}
+
+	uint64_t reserved = 0;
+	uint64_t allocated = 0;
+	size_t pendingLimit = 1;
+	std::vector<std::thread> pool;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::deque<Job> jobs;
+	bool stopping = false;
+	std::atomic<bool> failed{ false };
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+#else
+	int file = -1;
+#endif
+};
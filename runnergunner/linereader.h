@@ -0,0 +1,503 @@
+// linereader.h : Line-by-line readers for merge inputs.
+//
+// StreamLineReader is the classic buffered std::ifstream + std::getline path. MappedLineReader maps the
+// whole file and hands out views straight into the mapping, so no per-file user-space buffer is needed
+// and no byte is copied on its way to the tokenizer. Files inside archives (see tarfile.h) are always read
+// through the archive's mapping. Gzip-compressed files (.gz) are mapped and inflated a buffer at a time by
+// GzipLineReader, on whichever thread reads their lines. openLineRange reads only a range of a file's lines
+// (after its header): plain files are mapped and the range is located with memchr, without splitting or
+// copying the lines before it, from the nearest sampled offset if the file has a LineIndex; gzip files have
+// to be inflated up to it.
+
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <zlib.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+enum class InputReaderMode { stream, mmap };
+
+class MappedFile;
+
+// A file stored inside an archive, served from the archive's mapping under the path <archive>/<member>
+struct ArchiveMember {
+	std::shared_ptr<MappedFile> archive;
+	uint64_t offset = 0;
+	uint64_t size = 0;
+	int64_t mtime = 0;
+};
+
+// Registry of archive members by path; filled while gathering inputs, before any checking or merging threads start
+inline std::unordered_map<std::string, ArchiveMember>& archiveMembers() {
+	static std::unordered_map<std::string, ArchiveMember> members;
+	return members;
+}
+
+inline std::string archiveMemberKey(const std::filesystem::path& path) {
+	return path.lexically_normal().generic_string();
+}
+
+// The archive member at path, or nullptr if path is an ordinary file
+inline const ArchiveMember* findArchiveMember(const std::filesystem::path& path) {
+	auto& members = archiveMembers();
+	if (members.empty()) return nullptr;
+	const auto it = members.find(archiveMemberKey(path));
+	return (it == members.end()) ? nullptr : &it->second;
+}
+
+class LineReader {
+public:
+	virtual ~LineReader() = default;
+
+	// Reads the next line, without its '\n'. The view is only valid until the next call unless stableLines() is true,
+	// in which case it stays valid for the lifetime of the reader.
+	virtual bool getline(std::string_view& line) = 0;
+	virtual bool stableLines() const { return false; }
+
+	// Why reading stopped early, once getline has returned false; empty at a clean end of file
+	virtual std::string error() const { return std::string(); }
+};
+
+class StreamLineReader : public LineReader {
+public:
+	static constexpr size_t bufSize = 1048576; // 1 mb
+
+	explicit StreamLineReader(const std::filesystem::path& path) : buffer(new char[bufSize]) {
+		stream.rdbuf()->pubsetbuf(buffer.get(), bufSize);
+		stream.open(path);
+	}
+
+	bool good() const { return stream.good(); }
+
+	bool getline(std::string_view& line) override {
+		if (!std::getline(stream, current)) return false;
+		line = current;
+		return true;
+	}
+
+private:
+	std::unique_ptr<char[]> buffer;
+	std::ifstream stream;
+	std::string current;
+};
+
+// Read-only mapping of a whole file
+class MappedFile {
+public:
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile() {
+		if (_archive) return; // the bytes belong to the archive's mapping
+#ifdef _WIN32
+		if (_data) UnmapViewOfFile(_data);
+		if (_mapping) CloseHandle(_mapping);
+		if (_file != INVALID_HANDLE_VALUE) CloseHandle(_file);
+#else
+		if (_data) munmap((void*)_data, _size);
+		if (_fd >= 0) close(_fd);
+#endif
+	}
+
+	// Maps the file; returns false if it could not be opened or mapped. Empty files map to an empty view.
+	bool open(const std::filesystem::path& path, bool sequential = true) {
+		if (auto member = findArchiveMember(path)) {
+			_archive = member->archive;
+			_data = _archive->view().data() + member->offset;
+			_size = (size_t)member->size;
+			return true;
+		}
+#ifdef _WIN32
+		_file = CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+			sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_ATTRIBUTE_NORMAL, NULL);
+		if (_file == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(_file, &size)) return false;
+		_size = (size_t)size.QuadPart;
+		if (!_size) return true;
+		_mapping = CreateFileMappingW(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (!_mapping) return false;
+		_data = (const char*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+		return _data != nullptr;
+#else
+		_fd = ::open(path.c_str(), O_RDONLY);
+		if (_fd < 0) return false;
+		struct stat st;
+		if (fstat(_fd, &st) != 0) return false;
+		_size = (size_t)st.st_size;
+		if (!_size) return true;
+		void* mapped = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+		if (mapped == MAP_FAILED) return false;
+		_data = (const char*)mapped;
+		if (sequential) madvise(mapped, _size, MADV_SEQUENTIAL);
+		return true;
+#endif
+	}
+
+	std::string_view view() const { return std::string_view(_data, _size); }
+
+private:
+	const char* _data = nullptr;
+	size_t _size = 0;
+	std::shared_ptr<MappedFile> _archive; // set for archive members, whose bytes live in the archive's mapping
+#ifdef _WIN32
+	HANDLE _file = INVALID_HANDLE_VALUE;
+	HANDLE _mapping = NULL;
+#else
+	int _fd = -1;
+#endif
+};
+
+class MappedLineReader : public LineReader {
+public:
+	explicit MappedLineReader(std::shared_ptr<MappedFile> mappedfile) : file(std::move(mappedfile)), rest(file->view()) {}
+	// Reads lines of text held by the caller, which must outlive the reader
+	explicit MappedLineReader(std::string_view text) : rest(text) {}
+	// Reads the lines of head and then those of body, both parts of the mapped file
+	MappedLineReader(std::shared_ptr<MappedFile> mappedfile, std::string_view head, std::string_view body)
+		: file(std::move(mappedfile)), rest(head), following(body) {}
+
+	bool getline(std::string_view& line) override {
+		if (rest.empty()) {
+			rest = following;
+			following = std::string_view();
+		}
+		if (rest.empty()) return false;
+		const char* eol = (const char*)std::memchr(rest.data(), '\n', rest.size());
+		const size_t len = eol ? (size_t)(eol - rest.data()) : rest.size();
+		line = rest.substr(0, len);
+		rest.remove_prefix(eol ? len + 1 : len);
+		return true;
+	}
+
+	bool stableLines() const override { return true; }
+
+private:
+	std::shared_ptr<MappedFile> file;
+	std::string_view rest;
+	std::string_view following;
+};
+
+// Offset just past `count` more lines of text from offset (text.size() if it has fewer)
+inline size_t skipLines(std::string_view text, size_t offset, uint64_t count) {
+	for (; count && offset < text.size(); --count) {
+		const char* eol = (const char*)std::memchr(text.data() + offset, '\n', text.size() - offset);
+		offset = eol ? (size_t)(eol - text.data()) + 1 : text.size();
+	}
+	return offset;
+}
+
+constexpr uint64_t lineIndexStep = 1024;
+
+// Sampled line offsets of the start of a plain file (or all of it), so that a line can be found without reading
+// the lines before it. The index grows as far as the lines a reader has had to find.
+struct LineIndex {
+	uint64_t lines = UINT64_MAX; // lines of the file (a last line without '\n' included), once the samples reach its end
+	std::vector<uint64_t> offsets; // offsets[i] is where line i * lineIndexStep starts; empty if not built
+
+	bool empty() const { return offsets.empty(); }
+	bool complete() const { return lines != UINT64_MAX; }
+
+	// Offset of the given line of text (text.size() past the last line). A sample that does not start a line,
+	// e.g. from an index of an older version of the file, is not used.
+	size_t seek(std::string_view text, const uint64_t line) const {
+		const size_t sample = empty() ? 0 : (size_t)std::min<uint64_t>(line / lineIndexStep, offsets.size() - 1);
+		const uint64_t offset = empty() ? 0 : offsets[sample];
+		if (!_startsLine(text, offset)) return skipLines(text, 0, line);
+		return skipLines(text, (size_t)offset, line - sample * lineIndexStep);
+	}
+
+	// Samples the lines of text up to the given line (UINT64_MAX for all of them), going on from the last sample
+	// unless it no longer starts a line
+	void extend(std::string_view text, const uint64_t upto) {
+		if (!empty() && !_startsLine(text, offsets.back())) *this = LineIndex();
+		if (complete()) return;
+		if (empty()) offsets.push_back(0);
+		uint64_t line = (offsets.size() - 1) * lineIndexStep;
+		size_t offset = (size_t)offsets.back();
+		while (line < upto && offset < text.size()) {
+			offset = skipLines(text, offset, 1);
+			if (!(++line % lineIndexStep) && offset < text.size()) offsets.push_back(offset);
+		}
+		if (offset >= text.size()) lines = line;
+	}
+
+private:
+	static bool _startsLine(std::string_view text, const uint64_t offset) {
+		return offset <= text.size() && (!offset || text[offset - 1] == '\n');
+	}
+};
+
+// Passes on the first headLines lines of another reader, skips the next `skip` lines and then passes on up to
+// `count` lines, for readers that cannot seek
+class LineRangeReader : public LineReader {
+public:
+	LineRangeReader(std::shared_ptr<LineReader> reader, const uint64_t headLines, const uint64_t skip, const uint64_t count)
+		: inner(std::move(reader)), head(headLines), skipped(skip), left(count) {}
+
+	bool getline(std::string_view& line) override {
+		if (head) {
+			--head;
+			return inner->getline(line);
+		}
+		for (; skipped; --skipped) {
+			if (!inner->getline(line)) return false;
+		}
+		if (!left || !inner->getline(line)) return false;
+		--left;
+		return true;
+	}
+
+	bool stableLines() const override { return inner->stableLines(); }
+	std::string error() const override { return inner->error(); }
+
+private:
+	std::shared_ptr<LineReader> inner;
+	uint64_t head, skipped, left;
+};
+
+// Whether a path names a gzip-compressed file
+inline bool isGzipPath(const std::filesystem::path& path) {
+	return path.extension() == ".gz";
+}
+
+// Inflates a mapped gzip file (or a concatenation of gzip members, as written by bgzip or pigz) into a buffer
+// that is refilled as lines are taken from it; a line longer than the buffer grows it.
+class GzipLineReader : public LineReader {
+public:
+	static constexpr size_t bufSize = 1048576; // 1 mb
+
+	explicit GzipLineReader(std::shared_ptr<MappedFile> mappedfile, const size_t bufferSize = bufSize)
+		: file(std::move(mappedfile)), input(file->view()), buffer(new char[bufferSize]), capacity(bufferSize)
+	{
+		std::memset(&stream, 0, sizeof(stream));
+		if (inflateInit2(&stream, 15 + 32) != Z_OK) { // 15 + 32: gzip or zlib header, detected automatically
+			failure = "could not start decompression";
+			finished = true;
+		}
+	}
+
+	~GzipLineReader() override { inflateEnd(&stream); }
+
+	bool getline(std::string_view& line) override {
+		for (;;) {
+			const char* eol = (const char*)std::memchr(buffer.get() + scanned, '\n', end - scanned);
+			if (eol) {
+				line = std::string_view(buffer.get() + begin, eol - buffer.get() - begin);
+				begin = scanned = eol - buffer.get() + 1;
+				return true;
+			}
+			scanned = end;
+			if (finished) {
+				if (begin == end || !failure.empty()) return false;
+				line = std::string_view(buffer.get() + begin, end - begin); // last line without '\n'
+				begin = end;
+				return true;
+			}
+			_refill();
+		}
+	}
+
+	std::string error() const override { return failure; }
+
+private:
+	// Moves the partial line to the front of the buffer (growing it if the line fills it) and inflates behind it
+	void _refill() {
+		if (begin) {
+			std::memmove(buffer.get(), buffer.get() + begin, end - begin);
+			end -= begin;
+			scanned -= begin;
+			begin = 0;
+		}
+		if (end == capacity) {
+			std::unique_ptr<char[]> grown(new char[capacity * 2]);
+			std::memcpy(grown.get(), buffer.get(), end);
+			buffer.swap(grown);
+			capacity *= 2;
+		}
+		stream.next_out = (Bytef*)buffer.get() + end;
+		stream.avail_out = (uInt)std::min<size_t>(capacity - end, UINT32_MAX);
+		const uInt room = stream.avail_out;
+		while (stream.avail_out == room && !finished) {
+			if (!stream.avail_in) {
+				if (input.empty()) {
+					if (!atMemberEnd) failure = "unexpected end of compressed data";
+					finished = true;
+					break;
+				}
+				const size_t feed = std::min<size_t>(input.size(), 1u << 30);
+				stream.next_in = (Bytef*)input.data();
+				stream.avail_in = (uInt)feed;
+				input.remove_prefix(feed);
+			}
+			atMemberEnd = false;
+			const int result = inflate(&stream, Z_NO_FLUSH);
+			if (result == Z_STREAM_END) {
+				atMemberEnd = true;
+				if (stream.avail_in || !input.empty()) inflateReset(&stream); // another gzip member follows
+			}
+			else if (result != Z_OK && result != Z_BUF_ERROR) {
+				failure = stream.msg ? stream.msg : "corrupt compressed data";
+				finished = true;
+			}
+		}
+		end += room - stream.avail_out;
+	}
+
+	std::shared_ptr<MappedFile> file;
+	std::string_view input; // compressed bytes not yet handed to zlib
+	z_stream stream;
+	std::unique_ptr<char[]> buffer;
+	size_t capacity;
+	size_t begin = 0, scanned = 0, end = 0; // next line, end of the bytes searched for '\n', end of the inflated bytes
+	bool atMemberEnd = false;
+	bool finished = false;
+	std::string failure;
+};
+
+// Inflates a whole gzip file into text; false if it could not be opened or is corrupt
+inline bool inflateFile(const std::filesystem::path& path, std::string& text) {
+	auto mapped = std::make_shared<MappedFile>();
+	if (!mapped->open(path)) return false;
+	GzipLineReader reader(mapped);
+	text.clear();
+	text.reserve(mapped->view().size() * 4);
+	std::string_view line;
+	while (reader.getline(line)) {
+		text.append(line);
+		text.push_back('\n');
+	}
+	return reader.error().empty();
+}
+
+// Reads the first line of a file (without its '\n') with positioned reads of a few KB, so that header checks
+// never set up a full stream or read past the header. Returns false if the file could not be opened; an empty
+// file gives an empty line.
+inline bool readFirstLine(const std::filesystem::path& path, std::string& line, const size_t chunkSize = 4096) {
+	line.clear();
+	if (isGzipPath(path)) { // inflate a single chunk-sized buffer, unless the line is longer
+		auto mapped = std::make_shared<MappedFile>();
+		if (!mapped->open(path, false)) return false;
+		GzipLineReader reader(mapped, chunkSize);
+		std::string_view first;
+		if (reader.getline(first)) line = first;
+		return true;
+	}
+	if (findArchiveMember(path)) {
+		MappedFile member;
+		if (!member.open(path)) return false;
+		const std::string_view data = member.view();
+		line = data.substr(0, std::min(data.find('\n'), data.size()));
+		return true;
+	}
+#ifdef _WIN32
+	std::ifstream stream(path, std::ios::binary);
+	if (!stream.good()) return false;
+	auto readChunk = [&](char* buf) -> size_t {
+		stream.read(buf, chunkSize);
+		return (size_t)stream.gcount();
+	};
+#else
+	const int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	off_t offset = 0;
+	auto readChunk = [&](char* buf) -> size_t {
+		const ssize_t got = pread(fd, buf, chunkSize, offset);
+		if (got <= 0) return 0;
+		offset += got;
+		return (size_t)got;
+	};
+#endif
+	std::string chunk(chunkSize, '\0');
+	for (size_t got; (got = readChunk(&chunk[0])) > 0;) {
+		const size_t eol = std::string_view(chunk.data(), got).find('\n');
+		line.append(chunk.data(), eol == std::string_view::npos ? got : eol);
+		if (eol != std::string_view::npos) break;
+	}
+#ifndef _WIN32
+	close(fd);
+#endif
+	return true;
+}
+
+// Opens a reader over the file in the requested mode; returns nullptr if the file could not be opened
+inline std::shared_ptr<LineReader> openLineReader(const std::filesystem::path& path, const InputReaderMode mode) {
+	if (isGzipPath(path)) {
+		auto mapped = std::make_shared<MappedFile>();
+		if (!mapped->open(path)) return nullptr;
+		return std::make_shared<GzipLineReader>(mapped);
+	}
+	if (mode == InputReaderMode::mmap || findArchiveMember(path)) {
+		auto mapped = std::make_shared<MappedFile>();
+		if (!mapped->open(path)) return nullptr;
+		return std::make_shared<MappedLineReader>(mapped);
+	}
+	auto reader = std::make_shared<StreamLineReader>(path);
+	if (!reader->good()) return nullptr;
+	return reader;
+}
+
+// Opens a reader over the header line (if header is set) and then `count` lines from line `first` after it
+// (all the rest if count is UINT64_MAX), located through the file's index if it has one; returns nullptr if the
+// file could not be opened
+inline std::shared_ptr<LineReader> openLineRange(const std::filesystem::path& path, const bool header, const uint64_t first, const uint64_t count,
+	const LineIndex& index = LineIndex()) {
+	auto mapped = std::make_shared<MappedFile>();
+	if (!mapped->open(path, false)) return nullptr;
+	if (isGzipPath(path)) return std::make_shared<LineRangeReader>(std::make_shared<GzipLineReader>(mapped), header ? 1 : 0, first, count);
+	const std::string_view text = mapped->view();
+	const uint64_t headLines = header ? 1 : 0;
+	const size_t headEnd = skipLines(text, 0, headLines);
+	const size_t begin = index.seek(text, headLines + first);
+	const size_t end = (count == UINT64_MAX) ? text.size() : index.seek(text, headLines + first + count);
+	return std::make_shared<MappedLineReader>(mapped, text.substr(0, headEnd), text.substr(begin, end - begin));
+}
+
+// Extends the line index of a plain file up to the given line (see LineIndex::extend); false if the file could not
+// be read or is compressed
+inline bool extendLineIndex(const std::filesystem::path& path, LineIndex& index, const uint64_t upto) {
+	MappedFile mapped;
+	if (isGzipPath(path) || !mapped.open(path, false)) return false;
+	index.extend(mapped.view(), upto);
+	return true;
+}
+
+// Counts the lines of a file (a last line without '\n' included); false if it could not be read
+inline bool countLines(const std::filesystem::path& path, uint64_t& lines) {
+	lines = 0;
+	auto mapped = std::make_shared<MappedFile>();
+	if (!mapped->open(path)) return false;
+	if (isGzipPath(path)) {
+		GzipLineReader reader(mapped);
+		std::string_view line;
+		while (reader.getline(line)) ++lines;
+		return reader.error().empty();
+	}
+	const std::string_view text = mapped->view();
+	lines = (uint64_t)std::count(text.begin(), text.end(), '\n');
+	if (!text.empty() && text.back() != '\n') ++lines;
+	return true;
+}
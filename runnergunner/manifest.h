@@ -0,0 +1,168 @@
+// manifest.h : Cache of checked input files, kept next to the output file.
+//
+// For every valid input the manifest records its size, modification time, a hash of its first bytes, its type,
+// its runs and, for text inputs, the fingerprint of its gene order. A file whose size and modification time still
+// match is trusted without being opened; if only the time differs (e.g. after a copy), the head hash decides. The
+// gene order fingerprint is only reused if size, time and head hash all match, and is taken again otherwise.
+// Files that a sharded merge (--shard) has read into also keep their LineIndex, as far as it goes, for as long as
+// their size and modification time match. The manifest is a tab-separated text file:
+//   RNA-see runnergunner manifest <version>
+//   path size mtime headhash type genefingerprint nlines noffsets offset1 offset2 ... nruns run1 col1 run2 col2 ...
+
+#pragma once
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include "linereader.h"
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+constexpr uint64_t fnvOffsetBasis = 14695981039346656037ull;
+constexpr size_t manifestHeadBytes = 65536;
+
+inline uint64_t fnv1a64(const char* data, const size_t len, uint64_t hash = fnvOffsetBasis) {
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+// Order-sensitive hash of a gene list, fed one name at a time
+class GeneFingerprint {
+public:
+	void add(std::string_view gene) {
+		hash = fnv1a64(gene.data(), gene.size(), hash);
+		hash = fnv1a64("\n", 1, hash);
+	}
+	uint64_t value() const { return hash; }
+
+private:
+	uint64_t hash = fnvOffsetBasis;
+};
+
+// Hash of the first manifestHeadBytes bytes of a file; 0 if it could not be read
+inline uint64_t hashFileHead(const std::filesystem::path& path) {
+	if (findArchiveMember(path)) {
+		MappedFile member;
+		if (!member.open(path)) return 0;
+		const std::string_view head = member.view().substr(0, manifestHeadBytes);
+		return fnv1a64(head.data(), head.size());
+	}
+	std::ifstream in(path, std::ios::binary);
+	if (!in.good()) return 0;
+	std::string head(manifestHeadBytes, '\0');
+	in.read(&head[0], head.size());
+	return fnv1a64(head.data(), (size_t)in.gcount());
+}
+
+// Size and modification time of a file; false if it could not be queried
+inline bool statFile(const std::filesystem::path& path, uint64_t& size, int64_t& mtime) {
+	if (auto member = findArchiveMember(path)) {
+		size = member->size;
+		mtime = member->mtime;
+		return true;
+	}
+	std::error_code ec;
+	size = (uint64_t)std::filesystem::file_size(path, ec);
+	if (ec) return false;
+	const auto time = std::filesystem::last_write_time(path, ec);
+	if (ec) return false;
+	mtime = (int64_t)time.time_since_epoch().count();
+	return true;
+}
+
+struct ManifestColumn {
+	std::string runname;
+	size_t colnum;
+};
+
+struct ManifestEntry {
+	uint64_t size = 0;
+	int64_t mtime = 0;
+	uint64_t headHash = 0;
+	int filetype = 0;
+	uint64_t geneFingerprint = 0; // 0 if not known
+	LineIndex lineIndex;
+	std::vector<ManifestColumn> columns;
+};
+
+class InputManifest {
+public:
+	static constexpr int version = 4;
+
+	// Key under which a file is recorded, independent of the working directory
+	static std::string key(const std::filesystem::path& path) {
+		return std::filesystem::absolute(path).lexically_normal().string();
+	}
+
+	// Loads a manifest; a missing, unreadable or outdated manifest simply leaves it empty
+	bool load(const std::filesystem::path& path) {
+		entries.clear();
+		std::ifstream in(path);
+		std::string line;
+		if (!std::getline(in, line) || line != _header()) return false;
+		while (std::getline(in, line)) {
+			std::istringstream fields(line);
+			std::string file, field;
+			ManifestEntry entry;
+			size_t noffsets = 0, nruns = 0;
+			if (!std::getline(fields, file, '\t')) continue;
+			if (!(fields >> entry.size >> entry.mtime >> std::hex >> entry.headHash >> std::dec >> entry.filetype
+				>> std::hex >> entry.geneFingerprint >> std::dec >> entry.lineIndex.lines >> noffsets)) continue;
+			entry.lineIndex.offsets.resize(std::min<size_t>(noffsets, entry.size / lineIndexStep + 1));
+			for (auto& offset : entry.lineIndex.offsets) fields >> offset;
+			if (!(fields >> nruns) || noffsets != entry.lineIndex.offsets.size()) continue;
+			fields.get(); // tab before the first run
+			bool good = true;
+			for (size_t i = 0; i < nruns && good; ++i) {
+				ManifestColumn col;
+				good = std::getline(fields, col.runname, '\t') && std::getline(fields, field, '\t');
+				if (good) {
+					const auto result = std::from_chars(field.data(), field.data() + field.size(), col.colnum);
+					good = result.ec == std::errc() && result.ptr == field.data() + field.size();
+				}
+				if (good) entry.columns.push_back(std::move(col));
+			}
+			if (good && nruns) entries[file] = std::move(entry);
+		}
+		return true;
+	}
+
+	// Writes the manifest next to its final name and then moves it into place
+	bool save(const std::filesystem::path& path) const {
+		const std::filesystem::path temp = path.string() + "_temp";
+		{
+			std::ofstream out(temp, std::ios::trunc);
+			out << _header() << "\n";
+			for (auto& [file, entry] : entries) {
+				out << file << "\t" << entry.size << "\t" << entry.mtime << "\t" << std::hex << entry.headHash << std::dec << "\t"
+					<< entry.filetype << "\t" << std::hex << entry.geneFingerprint << std::dec << "\t" << entry.lineIndex.lines << "\t" << entry.lineIndex.offsets.size();
+				for (auto offset : entry.lineIndex.offsets) out << "\t" << offset;
+				out << "\t" << entry.columns.size();
+				for (auto& col : entry.columns) out << "\t" << col.runname << "\t" << col.colnum;
+				out << "\n";
+			}
+			out.close();
+			if (out.fail()) return false;
+		}
+		std::error_code ec;
+		std::filesystem::rename(temp, path, ec);
+		return !ec;
+	}
+
+	const ManifestEntry* find(const std::string& file) const {
+		const auto it = entries.find(file);
+		return (it == entries.end()) ? nullptr : &it->second;
+	}
+
+	std::unordered_map<std::string, ManifestEntry> entries;
+
+private:
+	static std::string _header() { return "RNA-see runnergunner manifest\t" + std::to_string(version); }
+};
@@ -0,0 +1,131 @@
+// parallel.h : Small threading helpers shared by the checking and merging stages.
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+inline unsigned int defaultWorkerThreads() {
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Calls fn(i) for every i in [0, count) from up to `threads` threads (the calling thread included).
+// Indices are handed out in increasing order, but may complete in any order.
+template <typename Fn>
+void parallelFor(size_t count, unsigned int threads, Fn&& fn) {
+	const size_t nthreads = std::min<size_t>(std::max(1u, threads), count);
+	if (nthreads <= 1) {
+		for (size_t i = 0; i < count; ++i) fn(i);
+		return;
+	}
+	std::atomic<size_t> next(0);
+	auto work = [&]() {
+		for (size_t i = next++; i < count; i = next++) fn(i);
+	};
+	std::vector<std::thread> pool;
+	pool.reserve(nthreads - 1);
+	for (size_t t = 1; t < nthreads; ++t) pool.emplace_back(work);
+	work();
+	for (auto& thread : pool) thread.join();
+}
+
+// Bounded multi-producer/multi-consumer queue (Dmitry Vyukov's array-based design): each cell carries a
+// sequence number that tells producers and consumers whether it is free or filled, so neither side takes a lock.
+template <typename T>
+class BoundedQueue {
+public:
+	explicit BoundedQueue(size_t capacity) {
+		size_t size = 2;
+		while (size < capacity) size <<= 1;
+		mask = size - 1;
+		cells.reset(new Cell[size]);
+		for (size_t i = 0; i < size; ++i) cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	bool tryPush(T& value) {
+		size_t pos = enqueuePos.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell& cell = cells[pos & mask];
+			const size_t seq = cell.sequence.load(std::memory_order_acquire);
+			const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					cell.data = std::move(value);
+					cell.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0) {
+				return false; // full
+			}
+			else {
+				pos = enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool tryPop(T& value) {
+		size_t pos = dequeuePos.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell& cell = cells[pos & mask];
+			const size_t seq = cell.sequence.load(std::memory_order_acquire);
+			const intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (diff == 0) {
+				if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					value = std::move(cell.data);
+					cell.sequence.store(pos + mask + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0) {
+				return false; // empty
+			}
+			else {
+				pos = dequeuePos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Blocking push; gives up (returning false) once abort() returns true
+	template <typename Abort>
+	bool push(T value, Abort&& abort) {
+		for (unsigned int spins = 0; !tryPush(value); ++spins) {
+			if (abort()) return false;
+			_backoff(spins);
+		}
+		return true;
+	}
+
+	// Blocking pop; returns false once the queue is empty and closed() returns true (all producers are done)
+	template <typename Closed>
+	bool pop(T& value, Closed&& closed) {
+		for (unsigned int spins = 0; !tryPop(value); ++spins) {
+			if (closed()) return tryPop(value);
+			_backoff(spins);
+		}
+		return true;
+	}
+
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	// Spin briefly, then yield, then sleep, so that a stage starved for long stretches does not burn a core
+	static void _backoff(unsigned int spins) {
+		if (spins < 64) return;
+		if (spins < 1024) std::this_thread::yield();
+		else std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+
+	std::unique_ptr<Cell[]> cells;
+	size_t mask = 0;
+	alignas(64) std::atomic<size_t> enqueuePos{ 0 };
+	alignas(64) std::atomic<size_t> dequeuePos{ 0 };
+};
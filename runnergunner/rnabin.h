@@ -0,0 +1,329 @@
+// rnabin.h : RNA-see binary matrix format (.rnabin).
+//
+// Numbers are stored little-endian (in host order; only little-endian hosts are supported), and every section starts on a 64-byte boundary, so that a mapped file can be
+// used in place:
+//   header   RnabinHeader (64 bytes)
+//   runs     run dictionary: for each run, a uint32 length followed by the name
+//   blocks   matrix blocks of up to blockRows gene rows by all runs, as float32 or float64. Within a block values
+//            are row-major (run index varies fastest) or column-major (gene index varies fastest).
+//   genes    gene dictionary: for each gene, a uint32 length followed by the name
+//   index    footer: uint64 block count, then for each block its uint64 file offset, first row and row count,
+//            followed by the 8-byte footer magic
+// The writer streams blocks as rows arrive and patches the row count and section offsets into the header at the end.
+
+#pragma once
+#include <algorithm>
+#include "blockwriter.h"
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include "linereader.h"
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum class RnabinType : uint8_t { float32 = 1, float64 = 2 };
+enum class RnabinLayout : uint8_t { rowmajor = 0, colmajor = 1 };
+
+constexpr char rnabinMagic[8] = { 'R', 'N', 'A', 'S', 'E', 'E', 'B', '1' };
+constexpr char rnabinFooterMagic[8] = { 'R', 'N', 'A', 'S', 'E', 'E', 'I', 'X' };
+constexpr uint32_t rnabinVersion = 1;
+constexpr uint64_t rnabinAlignment = 64;
+
+struct RnabinHeader {
+	char magic[8];
+	uint32_t version;
+	uint8_t dtype;
+	uint8_t layout;
+	uint16_t reserved;
+	uint64_t rows;
+	uint64_t cols;
+	uint64_t blockRows;
+	uint64_t runsOffset;
+	uint64_t genesOffset;
+	uint64_t indexOffset;
+};
+static_assert(sizeof(RnabinHeader) == 64, "RnabinHeader must be 64 bytes");
+
+struct RnabinBlock {
+	uint64_t offset;
+	uint64_t firstRow;
+	uint64_t rows;
+};
+
+inline size_t rnabinValueSize(const RnabinType dtype) {
+	return (dtype == RnabinType::float64) ? 8 : 4;
+}
+
+// Streams a gene x run matrix into a .rnabin file one row at a time
+class RnabinWriter {
+public:
+	bool open(const std::filesystem::path& path, const std::vector<std::string>& runs, const RnabinType type,
+		const RnabinLayout blockLayout, const uint64_t rowsPerBlock = 1024) {
+		dtype = type;
+		layout = blockLayout;
+		blockRows = rowsPerBlock;
+		cols = runs.size();
+		if (!out.open(path)) return false;
+
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, rnabinMagic, sizeof(rnabinMagic));
+		header.version = rnabinVersion;
+		header.dtype = (uint8_t)dtype;
+		header.layout = (uint8_t)layout;
+		header.cols = cols;
+		header.blockRows = blockRows;
+		out.write((const char*)&header, sizeof(header));
+		position = sizeof(header);
+
+		header.runsOffset = position;
+		std::string runDict;
+		for (auto& run : runs) _appendName(runDict, run);
+		_write(runDict.data(), runDict.size());
+		_pad();
+
+		block.reserve(blockRows * cols * rnabinValueSize(dtype));
+		return true;
+	}
+
+	// Adds the next gene row; values holds one value per run
+	void addRow(std::string_view gene, const double* values) {
+		_appendName(geneDict, gene);
+		if (layout == RnabinLayout::rowmajor) {
+			for (uint64_t c = 0; c < cols; ++c) _appendValue(block, values[c]);
+		}
+		else {
+			pendingRows.insert(pendingRows.end(), values, values + cols);
+		}
+		if (++blockFill == blockRows) _flushBlock();
+	}
+
+	bool finish() {
+		_flushBlock();
+		header.rows = rowsWritten;
+		header.genesOffset = position;
+		_write(geneDict.data(), geneDict.size());
+		_pad();
+
+		header.indexOffset = position;
+		const uint64_t nblocks = index.size();
+		_write((const char*)&nblocks, sizeof(nblocks));
+		if (nblocks) _write((const char*)index.data(), index.size() * sizeof(RnabinBlock));
+		_write(rnabinFooterMagic, sizeof(rnabinFooterMagic));
+
+		out.writeAt(0, (const char*)&header, sizeof(header));
+		return out.close();
+	}
+
+private:
+	static void _appendName(std::string& dict, std::string_view name) {
+		const uint32_t len = (uint32_t)name.size();
+		dict.append((const char*)&len, sizeof(len));
+		dict.append(name);
+	}
+
+	void _appendValue(std::string& dest, const double value) {
+		if (dtype == RnabinType::float64) {
+			dest.append((const char*)&value, sizeof(value));
+		}
+		else {
+			const float single = (float)value;
+			dest.append((const char*)&single, sizeof(single));
+		}
+	}
+
+	void _write(const char* data, size_t len) {
+		out.write(data, len);
+		position += len;
+	}
+
+	void _pad() {
+		static const char zeros[rnabinAlignment] = {};
+		const uint64_t padding = (rnabinAlignment - position % rnabinAlignment) % rnabinAlignment;
+		_write(zeros, padding);
+	}
+
+	void _flushBlock() {
+		if (!blockFill) return;
+		if (layout == RnabinLayout::colmajor) {
+			for (uint64_t c = 0; c < cols; ++c) {
+				for (uint64_t r = 0; r < blockFill; ++r) _appendValue(block, pendingRows[r * cols + c]);
+			}
+			pendingRows.clear();
+		}
+		index.push_back({ position, rowsWritten, blockFill });
+		_write(block.data(), block.size());
+		_pad();
+		block.clear();
+		rowsWritten += blockFill;
+		blockFill = 0;
+	}
+
+	BlockWriter out;
+	RnabinHeader header;
+	RnabinType dtype = RnabinType::float32;
+	RnabinLayout layout = RnabinLayout::rowmajor;
+	uint64_t blockRows = 1024;
+	uint64_t cols = 0;
+	uint64_t position = 0;
+	uint64_t rowsWritten = 0;
+	uint64_t blockFill = 0;
+	std::string block;
+	std::vector<double> pendingRows;
+	std::string geneDict;
+	std::vector<RnabinBlock> index;
+};
+
+// Read-only view of a mapped .rnabin file
+class RnabinFile {
+public:
+	// Maps and validates the file; on failure returns false and leaves the reason in error.
+	// With runsOnly, only the header, footer and run dictionary are looked at (and genes stays empty).
+	bool open(const std::filesystem::path& path, std::string& error, const bool runsOnly = false) {
+		mapped = std::make_shared<MappedFile>();
+		if (!mapped->open(path, false)) {
+			error = "failed to open";
+			return false;
+		}
+		data = mapped->view();
+		if (data.size() < sizeof(RnabinHeader) + sizeof(rnabinFooterMagic)) {
+			error = "too short to be an rnabin file";
+			return false;
+		}
+		std::memcpy(&header, data.data(), sizeof(header));
+		if (std::memcmp(header.magic, rnabinMagic, sizeof(rnabinMagic)) != 0 || header.version != rnabinVersion) {
+			error = "not an rnabin file of a supported version";
+			return false;
+		}
+		if (header.dtype != (uint8_t)RnabinType::float32 && header.dtype != (uint8_t)RnabinType::float64) {
+			error = "unknown value type";
+			return false;
+		}
+		if (header.layout != (uint8_t)RnabinLayout::rowmajor && header.layout != (uint8_t)RnabinLayout::colmajor) {
+			error = "unknown layout";
+			return false;
+		}
+		if (!header.indexOffset || header.indexOffset + sizeof(uint64_t) > data.size()
+			|| std::memcmp(data.data() + data.size() - sizeof(rnabinFooterMagic), rnabinFooterMagic, sizeof(rnabinFooterMagic)) != 0) {
+			error = "incomplete (no footer index)";
+			return false;
+		}
+		uint64_t nblocks;
+		std::memcpy(&nblocks, data.data() + header.indexOffset, sizeof(nblocks));
+		const uint64_t indexRoom = data.size() - header.indexOffset - sizeof(uint64_t);
+		if (indexRoom < sizeof(rnabinFooterMagic) || nblocks > (indexRoom - sizeof(rnabinFooterMagic)) / sizeof(RnabinBlock)) {
+			error = "corrupt footer index";
+			return false;
+		}
+		if (runsOnly) {
+			if (!_readNames(header.runsOffset, header.cols, runs)) {
+				error = "corrupt run dictionary";
+				return false;
+			}
+			return true;
+		}
+		if (!_readNames(header.runsOffset, header.cols, runs) || !_readNames(header.genesOffset, header.rows, genes)) {
+			error = "corrupt run or gene dictionary";
+			return false;
+		}
+		blocks.resize(nblocks);
+		if (nblocks) std::memcpy(blocks.data(), data.data() + header.indexOffset + sizeof(uint64_t), nblocks * sizeof(RnabinBlock));
+
+		// The blocks must cover rows 0 to rows - 1 in order, without gaps or overlaps, and lie within the file (the
+		// dictionaries bound rows and cols by the file size, so the block sizes below cannot overflow)
+		const uint64_t rowBytes = header.cols * rnabinValueSize(dtype());
+		uint64_t nextRow = 0;
+		for (auto& block : blocks) {
+			if (block.firstRow != nextRow || !block.rows || block.rows > header.rows - nextRow) {
+				error = "corrupt block index";
+				return false;
+			}
+			if (block.offset > data.size() || (rowBytes && block.rows > (data.size() - block.offset) / rowBytes)) {
+				error = "block extends past the end of the file";
+				return false;
+			}
+			nextRow += block.rows;
+		}
+		if (nextRow != header.rows) {
+			error = "block index does not cover every row";
+			return false;
+		}
+		return true;
+	}
+
+	RnabinType dtype() const { return (RnabinType)header.dtype; }
+	RnabinLayout layout() const { return (RnabinLayout)header.layout; }
+	uint64_t rows() const { return header.rows; }
+	uint64_t cols() const { return header.cols; }
+
+	std::vector<std::string_view> runs;
+	std::vector<std::string_view> genes;
+	std::vector<RnabinBlock> blocks;
+
+	// Converts the values of rows [firstRow, firstRow + nrows) and the given columns into dest, row after row,
+	// walking the stored blocks in their own order (so column-major blocks are read one column at a time)
+	void copyRows(const uint64_t firstRow, const uint64_t nrows, const std::vector<uint64_t>& columns, double* dest) const {
+		if (!nrows) return;
+		const size_t ncols = columns.size();
+		auto it = std::upper_bound(blocks.begin(), blocks.end(), firstRow, [](uint64_t r, const RnabinBlock& b) { return r < b.firstRow; }) - 1;
+		for (uint64_t row = firstRow; row < firstRow + nrows; ++it) {
+			const uint64_t begin = row - it->firstRow;
+			const uint64_t end = std::min<uint64_t>(it->rows, firstRow + nrows - it->firstRow);
+			const char* base = data.data() + it->offset;
+			double* blockDest = dest + (row - firstRow) * ncols;
+			if (layout() == RnabinLayout::rowmajor) {
+				for (uint64_t r = begin; r < end; ++r) {
+					for (size_t c = 0; c < ncols; ++c) blockDest[(r - begin) * ncols + c] = _load(base, r * header.cols + columns[c]);
+				}
+			}
+			else {
+				for (size_t c = 0; c < ncols; ++c) {
+					const uint64_t colBase = columns[c] * it->rows;
+					for (uint64_t r = begin; r < end; ++r) blockDest[(r - begin) * ncols + c] = _load(base, colBase + r);
+				}
+			}
+			row += end - begin;
+		}
+	}
+
+	// Value of a run (column) for a gene (row)
+	double value(const uint64_t row, const uint64_t col) const {
+		const auto it = std::upper_bound(blocks.begin(), blocks.end(), row, [](uint64_t r, const RnabinBlock& b) { return r < b.firstRow; }) - 1;
+		const uint64_t inBlock = row - it->firstRow;
+		const uint64_t index = (layout() == RnabinLayout::rowmajor) ? inBlock * header.cols + col : col * it->rows + inBlock;
+		return _load(data.data() + it->offset, index);
+	}
+
+private:
+	double _load(const char* base, const uint64_t index) const {
+		if (dtype() == RnabinType::float64) {
+			double value;
+			std::memcpy(&value, base + index * sizeof(double), sizeof(double));
+			return value;
+		}
+		float value;
+		std::memcpy(&value, base + index * sizeof(float), sizeof(float));
+		return value;
+	}
+
+	bool _readNames(uint64_t offset, const uint64_t count, std::vector<std::string_view>& names) {
+		names.clear();
+		if (offset > data.size() || count > (data.size() - offset) / sizeof(uint32_t)) return false; // every name has a length
+		names.reserve(count);
+		for (uint64_t i = 0; i < count; ++i) {
+			uint32_t len;
+			if (offset + sizeof(len) > data.size()) return false;
+			std::memcpy(&len, data.data() + offset, sizeof(len));
+			offset += sizeof(len);
+			if (len > data.size() - offset) return false;
+			names.push_back(data.substr(offset, len));
+			offset += len;
+		}
+		return true;
+	}
+
+	std::shared_ptr<MappedFile> mapped;
+	std::string_view data;
+	RnabinHeader header;
+};
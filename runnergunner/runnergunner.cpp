@@ -2,323 +2,1829 @@
 //
 
 #include "argparse.h"
+#include "blockwriter.h"
+#include "linereader.h"
+#include "manifest.h"
+#include "parallel.h"
+#include "rnabin.h"
+#include "sparse.h"
+#include "tarfile.h"
+#include "tokenizer.h"
+#include "tx2gene.h"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cmath>
+#include <condition_variable>
 #include <filesystem>
 #include <vector>
 #include <fstream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <stdlib.h>
 #include <set>
 #include <string>
 #include <string_view>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 
 unsigned int fileSystemMaxFilesOpen = 500;
+InputReaderMode inputReaderMode = InputReaderMode::stream;
+unsigned int workerThreads = defaultWorkerThreads();
+unsigned int columnGroups = 1;
+bool useManifest = true; // keep a manifest of checked inputs next to the output
+
+const std::vector<std::string> salmonColumns = { "Name", "Length", "EffectiveLength", "TPM", "NumReads" };
+const std::vector<std::string> kallistoColumns = { "target_id", "length", "eff_length", "est_counts", "tpm" };
+const size_t kallistoColumnOf[] = { 0, 1, 2, 4, 3 }; // position in abundance.tsv of each Salmon column
+std::vector<size_t> quantities = { 3 }; // Salmon columns merged from each file, one output matrix per column
+
+// Generic tab-separated quantifier output: which fields hold the name and the value, and whether there is a header.
+// Fields are given by header name or by 1-based number.
+struct TsvSpec {
+	bool enabled = false;
+	std::string extension = ".tsv";
+	std::string id = "1";
+	std::string value = "2";
+	bool header = true;
+};
+TsvSpec tsvSpec;
+
+enum class JoinMode { none, inner, outer };
+JoinMode joinMode = JoinMode::none; // join inputs on gene name instead of requiring identical gene order
+std::string joinFill = "0"; // cell value of runs that lack a gene in an outer join
+const size_t inMemoryFanIn = 128; // joins and gene aggregation hold a whole batch in memory, so their batches stay narrower
+
+// Slice of the gene rows this process merges (--shard index/count): the count slices of the rows are merged by
+// separate runs into separate outputs, which the concat command then puts together
+struct ShardSpec {
+	uint64_t index = 0;
+	uint64_t count = 1;
+};
+ShardSpec shard;
+
+const unsigned int openFilesReserve = 16; // output, temporary files and standard streams
+const unsigned int openFilesAutoCap = 4096; // every stream-mode input holds a 1 mb buffer, so do not go wider unless asked to
+
+// Raises the soft open-file limit (RLIMIT_NOFILE, or the C runtime's stream limit on Windows) towards the hard limit
+// and returns how many input files one merge may hold open, keeping openFilesReserve descriptors aside.
+// If requested is non-zero, the limit is only raised as far as needed for that many files.
+unsigned int _configureOpenFileLimit(const unsigned int requested = 0) {
+	const size_t wanted = requested ? (size_t)requested + openFilesReserve : (size_t)openFilesAutoCap + openFilesReserve;
+	size_t limit = 0;
+#ifdef _WIN32
+	limit = (size_t)_getmaxstdio();
+	if (limit < wanted) {
+		const int raised = _setmaxstdio((int)std::min<size_t>(wanted, 8192)); // CRT maximum
+		if (raised > 0) limit = (size_t)raised;
+	}
+#else
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0) return fileSystemMaxFilesOpen;
+	limit = (rl.rlim_cur == RLIM_INFINITY) ? wanted : (size_t)rl.rlim_cur;
+	if (limit < wanted) {
+		const rlim_t target = (rl.rlim_max == RLIM_INFINITY) ? (rlim_t)wanted : std::min<rlim_t>(rl.rlim_max, (rlim_t)wanted);
+		struct rlimit raised = rl;
+		raised.rlim_cur = target;
+		if (setrlimit(RLIMIT_NOFILE, &raised) == 0) limit = (size_t)target;
+	}
+#endif
+	const size_t usable = (limit > openFilesReserve + 2) ? limit - openFilesReserve : 2;
+	if (requested && usable < requested) {
+		std::cerr << "Cannot open " << requested << " files at once (open file limit is " << limit << "), merging at most " << usable << " at a time.\n";
+	}
+	return (unsigned int)std::min<size_t>(usable, wanted - openFilesReserve);
+}
 
-enum class FileType { Salmon, Tab, Either };
+enum class FileType { Salmon, Tab, Bin, Kallisto, Tsv, Either };
 
 struct DataColumn {
 	std::string runname = "none";
 	size_t colnum = 0;
+	size_t quantity = 0; // index into quantities of the value the column holds
 };
 
 struct InputFileData {
 	std::filesystem::path path = "none";
 	FileType filetype = FileType::Salmon;
 	std::vector<DataColumn> columns;
-	std::shared_ptr<std::ifstream> stream;
-	std::shared_ptr<char[]> buffer;
+	std::shared_ptr<LineReader> reader;
+	std::shared_ptr<RnabinFile> matrix; // open rnabin input (read through the mapping instead of a LineReader)
+	uint64_t geneFingerprint = 0; // fingerprint of the gene column (see manifest.h) once known, else 0
+	size_t fieldCount = 0; // tab-separated fields per line of an RNA-see tab file, from its header
+	size_t idColumn = 0; // field holding the gene (or transcript) name
+	bool hasHeader = true; // first line is a header rather than data
+	uint64_t firstRow = 0; // gene rows merged from the file: rowCount rows from firstRow on (see --shard), by default all
+	uint64_t rowCount = UINT64_MAX;
+	LineIndex lineIndex; // of a plain text file, as far as --shard has read into it (and kept in the manifest)
 };
 
+// Last field of a line the merge needs, so that shorter lines are caught as truncated
+size_t _lastField(const InputFileData& file) {
+	size_t last = file.idColumn;
+	for (auto& col : file.columns) last = std::max(last, col.colnum);
+	return last;
+}
+
 enum class RunnerOutput { normal, none, printruns, printgenes };
 
-// C code; should be fast
-inline void splitLineOnChar(const std::string& instring, const char& delimiter, std::vector<std::string>& tokens, const size_t& sizehint)
-{
-	tokens.clear();
-	tokens.reserve(sizehint);
-	const char* _Beg(&instring[0]), * _End(&instring[instring.size()]);
-	for (const char* _Ptr = _Beg; _Ptr < _End; ++_Ptr)
-	{
-		if (*_Ptr == delimiter)
-		{
-			tokens.push_back(std::string(_Beg, _Ptr));
-			_Beg = 1 + _Ptr;
-		}
+enum class OutputFormat { rnatab, rnabin, mtx, csc };
+
+// How text output writes values: cells as read from the inputs, or parsed and rewritten with a number of
+// significant digits (like printf's %g) or a number of decimals (%f)
+struct NumberFormat {
+	enum class Style { verbatim, significant, fixed };
+	Style style = Style::verbatim;
+	int digits = 0;
+
+	bool verbatim() const { return style == Style::verbatim; }
+};
+
+struct OutputOptions {
+	OutputFormat format = OutputFormat::rnatab;
+	RnabinType dtype = RnabinType::float32;
+	RnabinLayout layout = RnabinLayout::rowmajor;
+	std::shared_ptr<const Tx2Gene> tx2gene; // add up transcript rows into gene rows on the way out
+	NumberFormat numbers;
+	unsigned int writers = 1; // above 1, tab rows are formatted and written by this many threads at once
+};
+
+OutputOptions finalOutput; // format of the merged output file
+
+// Intermediate merge files are RNA-see tab files, unless the output is binary or sparse anyway: then they are
+// column-major .rnabin files of the output's value type (float64 for MatrixMarket text), which the next level reads
+// back without parsing. Gene aggregation happens where the original inputs are merged, so only files of the first
+// level are aggregated; likewise only tab files of the first level rewrite numbers, which later levels then pass
+// on as they are.
+OutputOptions _intermediateOutput(const bool aggregate) {
+	OutputOptions options;
+	if (aggregate) {
+		options.tx2gene = finalOutput.tx2gene;
+		options.numbers = finalOutput.numbers;
 	}
-	tokens.push_back(std::string(_Beg, _End));
+	if (finalOutput.format != OutputFormat::rnatab) {
+		options.format = OutputFormat::rnabin;
+		options.dtype = (finalOutput.format == OutputFormat::mtx) ? RnabinType::float64 : finalOutput.dtype;
+		options.layout = RnabinLayout::colmajor;
+		options.numbers = NumberFormat();
+	}
+	return options;
 }
 
-// C code; should be fast
-inline void splitLineOnCharSV(const std::string& instring, const char& delimiter, std::vector<std::string_view>& tokens, const size_t& sizehint)
-{
-	tokens.reserve(sizehint);
-	const char* _Beg(&instring[0]), * _End(&instring[instring.size()]);
-	for (const char* _Ptr = _Beg; _Ptr < _End; ++_Ptr)
-	{
-		if (*_Ptr == delimiter)
-		{
-			tokens.push_back(std::string(_Beg, _Ptr));
-			_Beg = 1 + _Ptr;
+// The path an input would have uncompressed (quant.sf for quant.sf.gz), from which its type and run name follow
+std::filesystem::path _plainPath(const std::filesystem::path& path) {
+	return isGzipPath(path) ? path.parent_path() / path.stem() : path;
+}
+
+// A Salmon or Kallisto file contributes one column per selected quantity, all named after its run
+void _setQuantityColumns(InputFileData& file, const std::string& run) {
+	file.columns.clear();
+	for (size_t q = 0; q < quantities.size(); ++q) {
+		const size_t colnum = (file.filetype == FileType::Kallisto) ? kallistoColumnOf[quantities[q]] : quantities[q];
+		file.columns.push_back({ run, colnum, q });
+	}
+}
+
+// Header checks report problems to err, so that concurrent checks can each collect their own messages
+int _checkSalmonFile(InputFileData & file, std::ostream& err = std::cerr) {
+	// Get first line and check that first line matches expectations
+	std::string line;
+	if (!readFirstLine(file.path, line)) {
+		err << "File " << file.path << " failed to open.\n";
+		return 0;
+	}
+	if (line.empty()) {
+		err << "Could not get first line from file " << file.path << "\n";
+		return 0;
+	}
+	std::vector<std::string_view> linesplit;
+	splitLineOnTabs(line, linesplit, 5);
+	if (linesplit.size() != 5) { // wrong number of columns
+		err << "File " << file.path << " should have had 5 columns, but actually had " << linesplit.size() << " and is being omitted\n";
+		return 0;
+	}
+	for (auto quantity : quantities) {
+		if (linesplit.at(quantity) != salmonColumns[quantity]) { // quantity not in correct position
+			err << "Column " << quantity << " of file " << file.path << " should have been " << salmonColumns[quantity] << ", but was actually: " << linesplit.at(quantity) << ". File is being omitted.\n";
+			return 0;
 		}
 	}
-	tokens.push_back(std::string(_Beg, _End));
+	file.filetype = FileType::Salmon;
+	// Salmon files are named after their run, unless they are a run directory's quant.sf
+	const auto plain = _plainPath(file.path);
+	const bool inRunDirectory = plain.stem() == "quant";
+	_setQuantityColumns(file, (inRunDirectory ? plain.parent_path().filename() : plain.stem()).string());
+	if (file.columns.front().runname.empty()) {
+		err << "File " << file.path << " is not in a directory named after its run and is being omitted\n";
+		return 0;
+	}
+	return 1;
 }
 
-inline void splitLineOnTabs(const std::string& line, std::vector<std::string>& tokens, const size_t& sizehint) {
-	splitLineOnChar(line, '\t', tokens, sizehint);
+// Kallisto abundance.tsv files: the header must match, and a file called abundance.tsv is named after its directory
+int _checkKallistoFile(InputFileData& file, std::ostream& err = std::cerr) {
+	std::string line;
+	if (!readFirstLine(file.path, line)) {
+		err << "File " << file.path << " failed to open.\n";
+		return 0;
+	}
+	std::vector<std::string_view> linesplit;
+	splitLineOnTabs(line, linesplit, 5);
+	if (linesplit.size() != kallistoColumns.size() || !std::equal(linesplit.begin(), linesplit.end(), kallistoColumns.begin())) {
+		err << "File " << file.path << " does not have a Kallisto abundance header and is being omitted\n";
+		return 0;
+	}
+	file.filetype = FileType::Kallisto;
+	const auto plain = _plainPath(file.path);
+	const bool inRunDirectory = plain.stem() == "abundance";
+	_setQuantityColumns(file, (inRunDirectory ? plain.parent_path().filename() : plain.stem()).string());
+	if (file.columns.front().runname.empty()) {
+		err << "File " << file.path << " is not in a directory named after its run and is being omitted\n";
+		return 0;
+	}
+	return 1;
 }
 
-inline void splitLineOnTabsSVT(const std::string& line, std::vector<std::string_view>& tokens, const size_t& sizehint) {
-	splitLineOnCharSV(line, '\t', tokens, sizehint);
+// Resolves a field given by header name or 1-based number; returns false if there is no such field
+bool _resolveField(const std::string& field, const std::vector<std::string_view>& header, const bool named, size_t& index) {
+	if (!field.empty() && std::all_of(field.begin(), field.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+		size_t number = 0;
+		if (std::from_chars(field.data(), field.data() + field.size(), number).ec != std::errc()) return false; // out of range
+		index = number - 1;
+		return number && index < header.size();
+	}
+	if (!named) return false;
+	const auto it = std::find(header.begin(), header.end(), field);
+	index = it - header.begin();
+	return it != header.end();
 }
 
-int _checkSalmonFile(InputFileData & file) {
-	std::ifstream newFileStream = std::ifstream(file.path);
-	if (newFileStream.good()) {
-		// Get first line and check that first line matches expectations
-		std::string line;
-		std::vector<std::string> linesplit;
-		if (std::getline(newFileStream, line)) {
-			splitLineOnTabs(line, linesplit, 5);
-			if (linesplit.size() != 5) { // wrong number of columns
-				std::cerr << "File " << file.path << " should have had 5 columns, but actually had " << linesplit.size() << " and is being omitted\n";
-				return 0;
-			}
-			else if (linesplit.at(3) != "TPM") { // TPM not in correct position
-				std::cerr << "Third column of file " << file.path << " should have been TPM, but was actually: " << linesplit.at(3) << ". File is being omitted.\n";
-				return 0;
-			}
-			file.columns.clear();
-			file.columns.push_back({ linesplit.at(3) , 3});
-		}
-		else {
-			std::cerr << "Could not get first line from file " << file.path << "\n";
-			return 0;
-		}
+// Generic tab-separated files, as described by tsvSpec; named after their run
+int _checkGenericFile(InputFileData& file, std::ostream& err = std::cerr) {
+	std::string line;
+	if (!readFirstLine(file.path, line)) {
+		err << "File " << file.path << " failed to open.\n";
+		return 0;
 	}
-	else {
-		std::cerr << "File " << file.path << " failed to open.\n";
+	std::vector<std::string_view> linesplit;
+	splitLineOnTabs(line, linesplit, 8);
+	size_t valueColumn;
+	if (!_resolveField(tsvSpec.id, linesplit, tsvSpec.header, file.idColumn) || !_resolveField(tsvSpec.value, linesplit, tsvSpec.header, valueColumn)) {
+		err << "File " << file.path << " has no field '" << tsvSpec.id << "' or '" << tsvSpec.value << "' and is being omitted\n";
 		return 0;
 	}
+	file.filetype = FileType::Tsv;
+	file.hasHeader = tsvSpec.header;
+	file.columns.clear();
+	file.columns.push_back({ _plainPath(file.path).stem().string(), valueColumn, 0 });
 	return 1;
 }
 
-int _checkTabFile(InputFileData & file) {
-	std::ifstream newFileStream = std::ifstream(file.path);
-	if (newFileStream.good()) {
-		// Get first line and check that first line matches expectations
-		std::string line;
-		std::vector<std::string> linesplit;
-		if (std::getline(newFileStream, line)) {
-			splitLineOnTabs(line, linesplit, 10);
-			const int numcols = linesplit.size();
-			if (numcols < 2) { // wrong number of columns
-				std::cerr << "File " << file.path << " should have had at least 2 columns, but actually had " << numcols << " and is being omitted\n";
-				return 0;
-			}
-			else if (linesplit.at(0) != "RNA-see TPM data file") { // TPM not in correct position
-				std::cerr << "First cell of file " << file.path << " should have been 'RNA-see TPM data file', but was actually: " << linesplit.at(0) << ". File is being omitted.\n";
-				return 0;
-			}
-			file.columns.clear();
-			
-			for (size_t i = 1; i < numcols; ++i) file.columns.push_back({ linesplit.at(i) , i });	
+int _checkTabFile(InputFileData & file, std::ostream& err = std::cerr) {
+	// Get first line and check that first line matches expectations
+	std::string line;
+	if (!readFirstLine(file.path, line)) {
+		err << "File " << file.path << " failed to open.\n";
+		return 0;
+	}
+	if (line.empty()) {
+		err << "Could not get first line from file " << file.path << "\n";
+		return 0;
+	}
+	std::vector<std::string_view> linesplit;
+	splitLineOnTabs(line, linesplit, 10);
+	const int numcols = linesplit.size();
+	if (numcols < 2) { // wrong number of columns
+		err << "File " << file.path << " should have had at least 2 columns, but actually had " << numcols << " and is being omitted\n";
+		return 0;
+	}
+	else if (linesplit.at(0) != "RNA-see TPM data file") { // TPM not in correct position
+		err << "First cell of file " << file.path << " should have been 'RNA-see TPM data file', but was actually: " << linesplit.at(0) << ". File is being omitted.\n";
+		return 0;
+	}
+	file.columns.clear();
+	
+	for (size_t i = 1; i < numcols; ++i) file.columns.push_back({ std::string(linesplit.at(i)) , i });	
+	return file.columns.size();
+}
+
+// Binary matrices are validated from their header, footer and run dictionary only
+int _checkBinFile(InputFileData & file, std::ostream& err = std::cerr) {
+	RnabinFile matrix;
+	std::string error;
+	if (!matrix.open(file.path, error, true)) {
+		err << "File " << file.path << " is not a valid RNA-see binary file (" << error << ") and is being omitted\n";
+		return 0;
+	}
+	file.columns.clear();
+	for (size_t i = 0; i < matrix.runs.size(); ++i) file.columns.push_back({ std::string(matrix.runs[i]), i });
+	return file.columns.size();
+}
+
+// Checks a single candidate file, returning the number of runs it adds (0 if it is skipped or invalid)
+// Text inputs may be gzip-compressed (quant.sf.gz); binary ones are used mapped, so never are.
+int _checkFile(InputFileData& filedata, const FileType filetype, std::ostream& err) {
+	const auto file = _plainPath(filedata.path);
+	int addedruns = 0;
+	if ((filetype == FileType::Salmon || filetype == FileType::Either) && (file.extension() == ".sf")) {
+		addedruns = _checkSalmonFile(filedata, err);
+		if (addedruns) {
+			filedata.filetype = FileType::Salmon;
 		}
 		else {
-			std::cerr << "Could not get first line from file " << file.path << "\n";
-			return 0;
+			err << "Invalid Salmon file: " << file << "\n";
 		}
 	}
-	else {
-		std::cerr << "File " << file.path << " failed to open.\n";
-		return 0;
+	if ((filetype == FileType::Tab || filetype == FileType::Either) && (file.extension() == ".rnatab")) {
+		addedruns = _checkTabFile(filedata, err);
+		if (addedruns) {
+			filedata.filetype = FileType::Tab;
+		}
+		else {
+			err << "Invalid RNA-see tab file: " << file << "\n";
+		}
 	}
-	return file.columns.size();
+	const bool kallisto = (filetype == FileType::Kallisto || filetype == FileType::Either) && (file.extension() == ".tsv");
+	const bool generic = (filetype == FileType::Tsv || filetype == FileType::Either) && tsvSpec.enabled && (file.extension() == tsvSpec.extension);
+	if (kallisto) {
+		std::ostringstream quiet; // a generic file is not expected to be a Kallisto file
+		addedruns = _checkKallistoFile(filedata, generic ? quiet : err);
+		if (!addedruns && !generic) err << "Invalid Kallisto file: " << file << "\n";
+	}
+	if (generic && !addedruns) {
+		addedruns = _checkGenericFile(filedata, err);
+		if (!addedruns) err << "Invalid tab-separated file: " << file << "\n";
+	}
+	if ((filetype == FileType::Bin || filetype == FileType::Either) && (filedata.path.extension() == ".rnabin")) {
+		addedruns = _checkBinFile(filedata, err);
+		if (addedruns) {
+			filedata.filetype = FileType::Bin;
+		}
+		else {
+			err << "Invalid RNA-see binary file: " << file << "\n";
+		}
+	}
+	return addedruns;
 }
 
-int _checkFiles(const std::vector<std::filesystem::path> files, std::vector<InputFileData>& invfiles, const FileType filetype = FileType::Either) {
-	int runsum = 0;
-	int fileschecked = 0;
+// Fingerprint of the gene column of a text input (see manifest.h), reading the file through once; 0 if it could not
+// be read or a line has no gene field, which leaves the file to the per-row gene name checks
+uint64_t _textGeneFingerprint(const InputFileData& file) {
+	auto reader = openLineReader(file.path, InputReaderMode::mmap);
+	if (!reader) return 0;
+	GeneFingerprint genes;
+	std::string_view line;
+	if (file.hasHeader && !reader->getline(line)) return 0;
+	while (reader->getline(line)) {
+		std::string_view gene = line;
+		for (size_t f = 0; f < file.idColumn; ++f) {
+			const size_t tab = gene.find('\t');
+			if (tab == std::string_view::npos) return 0;
+			gene.remove_prefix(tab + 1);
+		}
+		genes.add(gene.substr(0, std::min(gene.find('\t'), gene.size())));
+	}
+	return reader->error().empty() ? genes.value() : 0;
+}
+
+// Validates file headers on a pool of workerThreads threads. Valid files are appended to invfiles, and
+// error messages printed, in the same order as files regardless of which check finishes first.
+// With a manifest, files it records as unchanged are taken from it without being opened, and afterwards it is
+// replaced by the entries of this run's valid files. For a merge by position, text inputs also get the fingerprint
+// of their gene column, from the manifest if the file is unchanged by time and head hash both, else by reading it.
+int _checkFiles(const std::vector<std::filesystem::path> files, std::vector<InputFileData>& invfiles, const FileType filetype = FileType::Either,
+	InputManifest* manifest = nullptr) {
+	std::vector<InputFileData> checked(files.size());
+	std::vector<int> addedruns(files.size(), 0);
+	std::vector<std::string> messages(files.size());
+	std::vector<ManifestEntry> entries(manifest ? files.size() : 0);
+	std::vector<std::string> keys(manifest ? files.size() : 0);
+	std::atomic<size_t> fileschecked(0), filestrusted(0);
+	std::mutex progressMutex;
+	const bool fingerprints = joinMode == JoinMode::none; // a join matches rows by name anyway
 	std::cout << "\n";
-	for (auto& file : files) {
-		InputFileData filedata;
-		filedata.path = file;
-		int addedruns = 0;
-		if ((filetype == FileType::Salmon || filetype == FileType::Either) && (file.extension() == ".sf")) {
-			addedruns = _checkSalmonFile(filedata);
-			if (addedruns) {
-				filedata.filetype = FileType::Salmon;
-				invfiles.push_back(filedata);
-			}
-			else {
-				std::cerr << "Invalid Salmon file: " << file << "\n";
+	parallelFor(files.size(), workerThreads, [&](size_t i) {
+		checked[i].path = files[i];
+		bool trusted = false;
+		const ManifestEntry* known = nullptr;
+		if (manifest) {
+			keys[i] = InputManifest::key(files[i]);
+			ManifestEntry& entry = entries[i];
+			const bool stat = statFile(files[i], entry.size, entry.mtime);
+			known = stat ? manifest->find(keys[i]) : nullptr;
+			if (known && known->size == entry.size && (filetype == FileType::Either || known->filetype == (int)filetype)
+				&& known->filetype != (int)FileType::Tsv) { // generic files depend on the field spec, so they are always checked again
+				// The time or else the head hash vouch for the file; its gene fingerprint needs both
+				const bool sameTime = known->mtime == entry.mtime;
+				const bool sameHead = (!sameTime || (fingerprints && known->geneFingerprint)) && known->headHash == hashFileHead(files[i]);
+				trusted = sameTime || sameHead;
+				if (trusted) {
+					const int64_t mtime = entry.mtime;
+					entry = *known;
+					if (!sameTime) entry.lineIndex = LineIndex(); // the head hash says nothing about the lines past it
+					if (!sameTime || !sameHead) entry.geneFingerprint = 0;
+					entry.mtime = mtime;
+					checked[i].filetype = (FileType)entry.filetype;
+					if (checked[i].filetype == FileType::Salmon || checked[i].filetype == FileType::Kallisto) {
+						_setQuantityColumns(checked[i], entry.columns.front().runname); // quantities may differ from the last run
+					}
+					else for (auto& col : entry.columns) checked[i].columns.push_back({ col.runname, col.colnum });
+					addedruns[i] = (int)checked[i].columns.size();
+					++filestrusted;
+				}
 			}
 		}
-		if ((filetype == FileType::Tab || filetype == FileType::Either) && (file.extension() == ".rnatab")) {
-			addedruns = _checkTabFile(filedata);
-			if (addedruns) {
-				filedata.filetype = FileType::Tab;
-				invfiles.push_back(filedata);
-			}
-			else {
-				std::cerr << "Invalid RNA-see tab file: " << file << "\n";
+		if (!trusted) {
+			std::ostringstream err;
+			addedruns[i] = _checkFile(checked[i], filetype, err);
+			messages[i] = err.str();
+			if (manifest && addedruns[i]) {
+				ManifestEntry& entry = entries[i];
+				entry.headHash = hashFileHead(files[i]);
+				entry.filetype = (int)checked[i].filetype;
+				for (auto& col : checked[i].columns) entry.columns.push_back({ col.runname, col.colnum });
+				if (known && known->size == entry.size && known->mtime == entry.mtime) entry.lineIndex = known->lineIndex;
 			}
 		}
-		runsum += addedruns;
-		if (!(++fileschecked % 50)) {
-			std::cout << "\rChecked " << fileschecked << " files.";
+		if (addedruns[i] && fingerprints && checked[i].filetype != FileType::Bin) { // rnabin files hash their dictionary when opened
+			checked[i].geneFingerprint = manifest ? entries[i].geneFingerprint : 0;
+			if (!checked[i].geneFingerprint) checked[i].geneFingerprint = _textGeneFingerprint(checked[i]);
+			if (manifest) entries[i].geneFingerprint = checked[i].geneFingerprint;
+		}
+		if (manifest) checked[i].lineIndex = entries[i].lineIndex;
+		const size_t done = ++fileschecked;
+		if (!(done % 50)) {
+			std::lock_guard<std::mutex> lock(progressMutex);
+			std::cout << "\rChecked " << done << " files.";
+		}
+	});
+
+	int runsum = 0;
+	if (manifest) manifest->entries.clear();
+	for (size_t i = 0; i < files.size(); ++i) {
+		std::cerr << messages[i];
+		if (addedruns[i]) {
+			invfiles.push_back(std::move(checked[i]));
+			runsum += addedruns[i];
+			if (manifest) manifest->entries[keys[i]] = std::move(entries[i]);
 		}
 	}
-	std::cout << "\rChecked " << fileschecked << " files.\n";
+	std::cout << "\rChecked " << files.size() << " files";
+	if (manifest) std::cout << " (" << filestrusted << " unchanged since the last run)";
+	std::cout << ".\n";
 	return runsum;
 }
 
-void _mergeFilesBatch(std::vector<InputFileData>& batch, const std::string& outFilePath, const FileType filetype,
-	RunnerOutput specialmode) {
+// Consecutive lines of every file of one reader group. Lines are stored file by file: line r of the group's
+// file f is lines[f * rows + r].
+struct LineBlock {
+	size_t group = 0;
+	size_t block = 0;
+	size_t rows = 0;
+	std::string storage; // copies of lines from readers whose views do not outlive the next getline
+	std::vector<std::string_view> lines;
+};
 
-	try {
+// Formatted cells of one reader group for the rows of a LineBlock, ready to be put side by side with the other groups
+struct RowSegment {
+	size_t group = 0;
+	size_t block = 0;
+	size_t rows = 0;
+	size_t cols = 0;
+	std::string text;
+	std::vector<size_t> rowEnds; // row r of the segment is text[rowEnds[r - 1], rowEnds[r])
+	std::vector<double> values; // for numeric output: cols values per row, row after row
+	std::vector<std::string_view> genes; // gene name of each row, as read from the group's first file
+	std::shared_ptr<LineBlock> lines; // keeps the gene name views alive
+};
 
-		// Open input files and identify file types
-		for (auto& file : batch) {
-			const unsigned long bufSize = 1048576; // 1 mb
-			std::shared_ptr<char[]> fileBufferPtr(new char[bufSize]); //<char[]>(bufSize);
-			std::string name = file.path.stem().string();
-			auto newIfstreamPtr = std::make_shared<std::ifstream>(file.path);
-			newIfstreamPtr->rdbuf()->pubsetbuf(fileBufferPtr.get(), bufSize);
-			if (newIfstreamPtr->good()) {
-				file.stream.swap(newIfstreamPtr);
-				file.buffer.swap(fileBufferPtr);
-			}
-			else {
-				std::cerr << "File " << file.path << " failed to open.\n";
-				std::cerr << "You may be trying to combine more files than your operating system can simultaneously open.\n";
-				exit(1);
+// Appends a value as a text cell in the requested format; by default in the shortest form that reads back the same
+// value of the given type
+inline void _appendNumber(std::string& text, const double value, const RnabinType dtype, const NumberFormat& format = NumberFormat()) {
+	char buf[512]; // room for the fixed notation of any double
+	char* const end = buf + sizeof(buf);
+	std::to_chars_result result;
+	if (format.style == NumberFormat::Style::significant) result = std::to_chars(buf, end, value, std::chars_format::general, format.digits);
+	else if (format.style == NumberFormat::Style::fixed) result = std::to_chars(buf, end, value, std::chars_format::fixed, format.digits);
+	else if (dtype == RnabinType::float32) result = std::to_chars(buf, end, (float)value);
+	else result = std::to_chars(buf, end, value);
+	if (result.ec != std::errc()) result = std::to_chars(buf, end, value); // too long for the buffer in fixed notation
+	text.append(buf, result.ptr);
+}
+
+// Parses a numeric cell; returns false unless the whole cell is a number
+inline bool _parseCell(std::string_view cell, double& value) {
+	if (cell.size() == 1 && cell[0] == '0') { // by far the most common cell of sparse cohorts
+		value = 0;
+		return true;
+	}
+	const auto result = std::from_chars(cell.data(), cell.data() + cell.size(), value);
+	return result.ec == std::errc() && result.ptr == cell.data() + cell.size();
+}
+
+// Appends a text cell read from an input (preceded by its tab), rewritten in the given format unless that keeps
+// cells as read; returns false if a cell to be rewritten is not a number
+inline bool _appendCell(std::string& text, std::string_view cell, const NumberFormat& format) {
+	text.push_back('\t');
+	if (format.verbatim()) {
+		text.append(cell);
+		return true;
+	}
+	double value;
+	if (!_parseCell(cell, value)) return false;
+	_appendNumber(text, value, RnabinType::float64, format);
+	return true;
+}
+
+enum class CellFormat { none, text, numeric };
+
+// Adds the cells of a text input's runs, from the fields of its line for row r, to the segment in the given format;
+// returns false, with the error to report, if a cell is not a number
+inline bool _addCells(RowSegment& segment, const size_t r, const std::vector<std::string_view>& fields, const InputFileData& file,
+	const CellFormat cellFormat, const NumberFormat& numbers, std::string& error) {
+	for (auto& col : file.columns) {
+		const std::string_view cell = fields[col.colnum];
+		double value;
+		const bool good = (cellFormat == CellFormat::numeric) ? _parseCell(cell, value)
+			: (cellFormat != CellFormat::text || _appendCell(segment.text, cell, numbers));
+		if (!good) {
+			error = "Non-numeric value '" + std::string(cell) + "' for gene " + std::string(segment.genes[r]) + " in file " + file.path.string() + ". Aborting combination operation.\n";
+			return false;
+		}
+		if (cellFormat == CellFormat::numeric) segment.values.push_back(value);
+	}
+	return true;
+}
+
+// Destination of merged rows. The pipeline hands over the segments of each block of rows in column order,
+// formatted as cells() asks for (text cells with numbers written as numbers() asks for).
+class MatrixSink {
+public:
+	virtual ~MatrixSink() = default;
+	virtual CellFormat cells() const { return CellFormat::none; }
+	virtual NumberFormat numbers() const { return NumberFormat(); }
+	virtual bool open(const std::string& /*path*/, const std::vector<std::string>& /*runs*/) { return true; }
+	virtual void rows(const std::vector<std::shared_ptr<RowSegment>>& /*segments*/) {}
+	virtual bool finish() { return true; }
+};
+
+// Text outputs are formatted into the writer's blocks, which are flushed from its own thread (see blockwriter.h)
+class TextSink : public MatrixSink {
+public:
+	bool open(const std::string& path, const std::vector<std::string>& /*runs*/) override {
+		return out.open(path);
+	}
+
+	bool finish() override {
+		return out.close();
+	}
+
+protected:
+	BlockWriter out;
+};
+
+class TabSink : public TextSink {
+public:
+	explicit TabSink(const NumberFormat& format = NumberFormat()) : numberFormat(format) {}
+
+	CellFormat cells() const override { return CellFormat::text; }
+	NumberFormat numbers() const override { return numberFormat; }
+
+	bool open(const std::string& path, const std::vector<std::string>& runs) override {
+		if (!TextSink::open(path, runs)) return false;
+		out.write("RNA-see TPM data file"); // Output header line
+		for (auto& run : runs) {
+			out.put('\t');
+			out.write(run);
+		}
+		out.put('\n');
+		return true;
+	}
+
+	void rows(const std::vector<std::shared_ptr<RowSegment>>& segments) override {
+		for (size_t r = 0; r < segments.front()->rows; ++r) {
+			out.write(segments.front()->genes[r]);
+			for (auto& segment : segments) {
+				const size_t begin = r ? segment->rowEnds[r - 1] : 0;
+				out.write(segment->text.data() + begin, segment->rowEnds[r] - begin);
 			}
+			out.put('\n');
 		}
+	}
 
-		// Open and prep output file
-		std::ofstream out;
-		const unsigned long bufSize = 10485760; // 10 mb
-		auto outBuffer = std::make_unique<char[]>(bufSize);
-		if (specialmode != RunnerOutput::none) {
-			out = std::ofstream(outFilePath, std::ios::trunc);
-			out.rdbuf()->pubsetbuf(outBuffer.get(), bufSize);
-			if (!out.good()) {
-				throw("Failed to open output file for combined Salmon output");
-				exit(1);
+private:
+	NumberFormat numberFormat;
+};
+
+// Tab output written by several threads at once (--writers). The size of each block of rows is known as soon as
+// its cells are formatted, so its place in the file is reserved right away and the block is assembled and written
+// there by one of the writer's threads while the next blocks are being merged (see ShardedWriter in blockwriter.h).
+// The file comes out byte for byte as TabSink would write it.
+class ShardedTabSink : public MatrixSink {
+public:
+	ShardedTabSink(const NumberFormat& format, const unsigned int writers) : numberFormat(format), threads(writers) {}
+
+	CellFormat cells() const override { return CellFormat::text; }
+	NumberFormat numbers() const override { return numberFormat; }
+
+	bool open(const std::string& path, const std::vector<std::string>& runs) override {
+		if (!out.open(path, threads, 2 * (size_t)threads)) return false;
+		std::string header = "RNA-see TPM data file"; // Output header line
+		for (auto& run : runs) {
+			header.push_back('\t');
+			header.append(run);
+		}
+		header.push_back('\n');
+		return out.writeAt(out.reserve(header.size()), header.data(), header.size());
+	}
+
+	// The segments (and the lines their gene names point into) stay alive until the block is written; the inputs
+	// they were read from must stay open until finish
+	void rows(const std::vector<std::shared_ptr<RowSegment>>& segments) override {
+		const size_t count = segments.front()->rows;
+		if (!count) return;
+		uint64_t size = count; // newlines
+		for (auto& gene : segments.front()->genes) size += gene.size();
+		for (auto& segment : segments) size += segment->rowEnds[count - 1];
+		out.submit(out.reserve(size), [segments, count, size](std::string& text) {
+			text.reserve(size);
+			for (size_t r = 0; r < count; ++r) {
+				text.append(segments.front()->genes[r]);
+				for (auto& segment : segments) {
+					const size_t begin = r ? segment->rowEnds[r - 1] : 0;
+					text.append(segment->text, begin, segment->rowEnds[r] - begin);
+				}
+				text.push_back('\n');
 			}
+		});
+	}
+
+	bool finish() override {
+		return out.close();
+	}
+
+private:
+	NumberFormat numberFormat;
+	unsigned int threads;
+	ShardedWriter out;
+};
+
+class RunListSink : public TextSink {
+public:
+	bool open(const std::string& path, const std::vector<std::string>& runs) override {
+		if (!TextSink::open(path, runs)) return false;
+		for (auto& run : runs) {
+			out.write(run);
+			out.put('\n');
 		}
+		return true;
+	}
+};
 
-		// Prepare to merge the files
-		std::string fileLine;
-		std::vector<std::string> fileLineSplitVec;
+class GeneListSink : public TextSink {
+public:
+	void rows(const std::vector<std::shared_ptr<RowSegment>>& segments) override {
+		for (auto& gene : segments.front()->genes) {
+			out.write(gene);
+			out.put('\n');
+		}
+	}
+};
 
-		// Print file header line (if not outputting run/gene list
-		if (specialmode == RunnerOutput::normal) {
-			out << "RNA-see TPM data file"; // Output header line
+// Numeric outputs gather the values of each row from the segments into one row, which is handed to the writer
+// (RnabinWriter, MatrixMarketWriter or CscWriter) with its gene name. open must size the row to the runs.
+template <class Writer>
+class NumericSink : public MatrixSink {
+public:
+	CellFormat cells() const override { return CellFormat::numeric; }
+
+	void rows(const std::vector<std::shared_ptr<RowSegment>>& segments) override {
+		for (size_t r = 0; r < segments.front()->rows; ++r) {
+			double* dest = row.data();
+			for (auto& segment : segments) {
+				const double* src = segment->values.data() + r * segment->cols;
+				dest = std::copy(src, src + segment->cols, dest);
+			}
+			writer.addRow(segments.front()->genes[r], row.data());
 		}
+	}
 
-		// Loop through lines
-		bool eof = false;
-		bool header = true;
+protected:
+	Writer writer;
+	std::vector<double> row;
+};
 
-		unsigned long lineNo = 1;
-		while (!eof) {
-			bool firstfileofline = true;
-			std::string genename;
-			for (auto& file : batch) {
+class RnabinSink : public NumericSink<RnabinWriter> {
+public:
+	explicit RnabinSink(const OutputOptions& output) : options(output) {}
+
+	bool open(const std::string& path, const std::vector<std::string>& runs) override {
+		row.resize(runs.size());
+		return writer.open(path, runs, options.dtype, options.layout);
+	}
+
+	bool finish() override { return writer.finish(); }
+
+private:
+	OutputOptions options;
+};
+
+// Sparse outputs (see sparse.h) keep only the nonzero values of each row
+class MatrixMarketSink : public NumericSink<MatrixMarketWriter> {
+public:
+	explicit MatrixMarketSink(const OutputOptions& output) : numberFormat(output.numbers) {}
+
+	bool open(const std::string& path, const std::vector<std::string>& runs) override {
+		row.resize(runs.size());
+		const NumberFormat format = numberFormat;
+		return writer.open(path, runs, [format](std::string& text, double value) { _appendNumber(text, value, RnabinType::float64, format); });
+	}
+
+	bool finish() override {
+		std::cout << "Wrote " << writer.nonzeros() << " nonzero values.\n";
+		return writer.finish();
+	}
+
+private:
+	NumberFormat numberFormat;
+};
+
+class CscSink : public NumericSink<CscWriter> {
+public:
+	explicit CscSink(const OutputOptions& output) : options(output) {}
+
+	bool open(const std::string& path, const std::vector<std::string>& runs) override {
+		row.resize(runs.size());
+		return writer.open(path, runs, options.dtype);
+	}
+
+	bool finish() override {
+		std::cout << "Wrote " << writer.nonzeros() << " nonzero values.\n";
+		return writer.finish();
+	}
+
+private:
+	OutputOptions options;
+};
+
+// Adds up merged transcript rows into gene rows (see tx2gene.h), keeping one row of sums per gene in order of
+// first appearance, and hands the gene rows on to another sink once all transcripts are in. Transcripts missing
+// from the table are left out and counted.
+class GeneAggregateSink : public MatrixSink {
+public:
+	GeneAggregateSink(std::unique_ptr<MatrixSink> output, std::shared_ptr<const Tx2Gene> table)
+		: sink(std::move(output)), tx2gene(std::move(table)), slotOfGene(tx2gene->genes.size(), Tx2Gene::unmapped) {}
+
+	CellFormat cells() const override { return CellFormat::numeric; }
+
+	bool open(const std::string& path, const std::vector<std::string>& runs) override {
+		cols = runs.size();
+		return sink->open(path, runs);
+	}
+
+	void rows(const std::vector<std::shared_ptr<RowSegment>>& segments) override {
+		for (size_t r = 0; r < segments.front()->rows; ++r) {
+			const uint32_t gene = tx2gene->find(segments.front()->genes[r]);
+			if (gene == Tx2Gene::unmapped) {
+				++unmapped;
+				continue;
+			}
+			uint32_t& slot = slotOfGene[gene];
+			if (slot == Tx2Gene::unmapped) {
+				slot = (uint32_t)order.size();
+				order.push_back(gene);
+				sums.resize(sums.size() + cols, 0.0);
+			}
+			double* dest = sums.data() + (size_t)slot * cols;
+			for (auto& segment : segments) {
+				const double* src = segment->values.data() + r * segment->cols;
+				for (size_t c = 0; c < segment->cols; ++c) dest[c] += src[c];
+			}
+		}
+	}
+
+	bool finish() override {
+		if (unmapped) std::cerr << unmapped << " transcripts are not in the tx2gene table and were left out.\n";
+		const CellFormat format = sink->cells();
+		const NumberFormat numbers = sink->numbers();
+		for (size_t first = 0; first < order.size(); first += blockRows) {
+			auto segment = std::make_shared<RowSegment>();
+			segment->rows = std::min(blockRows, order.size() - first);
+			segment->cols = cols;
+			for (size_t r = first; r < first + segment->rows; ++r) {
+				const std::string_view gene = tx2gene->genes[order[r]];
+				const double* values = sums.data() + r * cols;
+				segment->genes.push_back(gene);
+				genes.add(gene);
+				if (format == CellFormat::text) {
+					for (size_t c = 0; c < cols; ++c) {
+						segment->text.push_back('\t');
+						_appendNumber(segment->text, values[c], RnabinType::float64, numbers);
+					}
+					segment->rowEnds.push_back(segment->text.size());
+				}
+				else if (format == CellFormat::numeric) {
+					segment->values.insert(segment->values.end(), values, values + cols);
+				}
+			}
+			sink->rows({ segment });
+		}
+		return sink->finish();
+	}
+
+	// Fingerprint of the gene rows written, once finish() has run
+	uint64_t geneFingerprint() const { return genes.value(); }
+
+private:
+	static constexpr size_t blockRows = 1024;
+
+	std::unique_ptr<MatrixSink> sink;
+	std::shared_ptr<const Tx2Gene> tx2gene;
+	size_t cols = 0;
+	std::vector<uint32_t> slotOfGene; // row of sums of each gene in the table, or unmapped
+	std::vector<uint32_t> order; // gene of each row of sums
+	std::vector<double> sums;
+	size_t unmapped = 0;
+	GeneFingerprint genes;
+};
+
+// Splits merged rows that interleave several quantities into one sink per quantity, given the quantity of each
+// merged column
+class QuantitySplitSink : public MatrixSink {
+public:
+	QuantitySplitSink(std::vector<std::unique_ptr<MatrixSink>> outputs, std::vector<std::string> paths, std::vector<size_t> columnQuantities)
+		: sinks(std::move(outputs)), outPaths(std::move(paths)), quantityOfColumn(std::move(columnQuantities)) {}
+
+	CellFormat cells() const override { return sinks.front()->cells(); }
+	NumberFormat numbers() const override { return sinks.front()->numbers(); }
+
+	bool open(const std::string& /*path*/, const std::vector<std::string>& runs) override {
+		for (size_t q = 0; q < sinks.size(); ++q) {
+			std::vector<std::string> quantityRuns;
+			for (size_t c = 0; c < runs.size(); ++c) {
+				if (quantityOfColumn[c] == q) quantityRuns.push_back(runs[c]);
+			}
+			if (!sinks[q]->open(outPaths[q], quantityRuns)) {
+				std::cerr << "Failed to open output file " << outPaths[q] << "\n";
+				return false;
+			}
+		}
+		return true;
+	}
 
-				// Determine if reached end
-				if (!std::getline(*(file.stream.get()), fileLine)) {
-					if (!firstfileofline) {
-						std::cerr << "File " << file.path << " ended prematurely. Aborting combination operation.\n";
-						exit(1);
+	void rows(const std::vector<std::shared_ptr<RowSegment>>& segments) override {
+		const CellFormat format = cells();
+		std::vector<std::shared_ptr<RowSegment>> split(sinks.size());
+		for (auto& segment : split) {
+			segment = std::make_shared<RowSegment>();
+			segment->rows = segments.front()->rows;
+			segment->genes = segments.front()->genes;
+			segment->lines = segments.front()->lines;
+		}
+		std::vector<std::string_view> cellsOfRow;
+		for (size_t r = 0; r < segments.front()->rows; ++r) {
+			size_t column = 0;
+			for (auto& segment : segments) {
+				if (format == CellFormat::text) { // cells of a row are each preceded by a tab
+					const size_t begin = r ? segment->rowEnds[r - 1] : 0;
+					const std::string_view row(segment->text.data() + begin, segment->rowEnds[r] - begin);
+					splitLineOnTabs(row, cellsOfRow, segment->cols + 1);
+					for (size_t c = 1; c < cellsOfRow.size(); ++c, ++column) {
+						auto& text = split[quantityOfColumn[column]]->text;
+						text.push_back('\t');
+						text.append(cellsOfRow[c]);
 					}
-					eof = true;
-					break;
-				};
+				}
+				else if (format == CellFormat::numeric) {
+					const double* values = segment->values.data() + r * segment->cols;
+					for (size_t c = 0; c < segment->cols; ++c, ++column) split[quantityOfColumn[column]]->values.push_back(values[c]);
+				}
+			}
+			for (auto& segment : split) segment->rowEnds.push_back(segment->text.size());
+		}
+		for (size_t q = 0; q < sinks.size(); ++q) {
+			split[q]->cols = std::count(quantityOfColumn.begin(), quantityOfColumn.end(), q);
+			sinks[q]->rows({ split[q] });
+		}
+	}
+
+	bool finish() override {
+		bool good = true;
+		for (size_t q = 0; q < sinks.size(); ++q) {
+			if (!sinks[q]->finish()) {
+				std::cerr << "Failed to write output file " << outPaths[q] << "\n";
+				good = false;
+			}
+		}
+		return good;
+	}
+
+private:
+	std::vector<std::unique_ptr<MatrixSink>> sinks;
+	std::vector<std::string> outPaths;
+	std::vector<size_t> quantityOfColumn;
+};
+
+std::unique_ptr<MatrixSink> _makeSink(const RunnerOutput specialmode, const OutputOptions& output) {
+	switch (specialmode) {
+	case RunnerOutput::none: return std::make_unique<MatrixSink>();
+	case RunnerOutput::printruns: return std::make_unique<RunListSink>();
+	case RunnerOutput::printgenes: return std::make_unique<GeneListSink>();
+	default: break;
+	}
+	if (output.format == OutputFormat::rnabin) return std::make_unique<RnabinSink>(output);
+	if (output.format == OutputFormat::mtx) return std::make_unique<MatrixMarketSink>(output);
+	if (output.format == OutputFormat::csc) return std::make_unique<CscSink>(output);
+	if (output.writers > 1) return std::make_unique<ShardedTabSink>(output.numbers, output.writers);
+	return std::make_unique<TabSink>(output.numbers);
+}
+
+// Merges one batch of files row by row. Reader threads each own a contiguous group of files and read them
+// in blocks of rows, parser workers split the lines, check gene names within the group and format the
+// group's cells, and a single writer thread checks gene names across groups and passes the rows on to the sink in order.
+// The stages are linked by bounded lock-free queues, and readers never run more than `window` blocks ahead
+// of the writer, which bounds memory use. With one thread the same stages run in turn on the calling thread.
+class BatchMergePipeline {
+public:
+	static constexpr size_t blockRows = 1024;
+	static constexpr size_t window = 4;
+
+	BatchMergePipeline(std::vector<InputFileData>& files, MatrixSink& output, const unsigned int threads, const bool showProgress)
+		: batch(files), sink(output), cellFormat(output.cells()), numbers(output.numbers()), progress(showProgress),
+		lineQueue(window * 2), segmentQueue(window * 2)
+	{
+		// Split the files into contiguous reader groups, keeping the remaining threads for parsers. Readers inflate
+		// compressed inputs as they go, so these get more readers.
+		const bool compressed = std::any_of(batch.begin(), batch.end(), [](const InputFileData& file) { return isGzipPath(file.path); });
+		const size_t readers = std::max<size_t>(1, std::min<size_t>(batch.size(), compressed ? threads / 2 : threads / 3));
+		parsers = std::max<size_t>(1, (threads > readers + 1) ? threads - readers - 1 : 1);
+		threaded = threads > 1;
+		for (size_t g = 0; g < readers; ++g) groupStarts.push_back(g * batch.size() / readers);
+		groupStarts.push_back(batch.size());
+
+		// Files known (from this run) to have the same gene order as their group's first file skip the per-row gene
+		// name checks, and groups whose first files share the first group's order skip the checks across groups
+		knownOrder.assign(batch.size(), false);
+		sameGroupOrder = batch.front().geneFingerprint != 0;
+		for (size_t g = 0; g < _groups(); ++g) {
+			const uint64_t reference = batch[groupStarts[g]].geneFingerprint;
+			if (reference != batch.front().geneFingerprint) sameGroupOrder = false;
+			for (size_t f = groupStarts[g] + 1; f < groupStarts[g + 1]; ++f) knownOrder[f] = reference && batch[f].geneFingerprint == reference;
+		}
+		wholeLine.assign(batch.size(), false);
+		for (size_t f = 0; f < batch.size(); ++f) {
+			lastField.push_back(_lastField(batch[f]));
+			auto& columns = batch[f].columns;
+			bool whole = batch[f].filetype == FileType::Tab && columns.size() + 1 == batch[f].fieldCount;
+			for (size_t c = 0; whole && c < columns.size(); ++c) whole = columns[c].colnum == c + 1;
+			wholeLine[f] = whole && numbers.verbatim() && (knownOrder[f] || (f == groupStarts[_group(f)] && batch[f].geneFingerprint));
+		}
+	}
+
+	// Runs the merge of all rows after the header into rows merged; false (with the reason reported) if it failed
+	bool run(size_t& rows) {
+		if (threaded) _runThreaded();
+		else _runSerial();
+		rows = rowsWritten;
+		if (failed) std::cerr << failure;
+		return !failed;
+	}
+
+	// Fingerprint of the merged gene order, once run() has returned
+	uint64_t geneFingerprint() const { return genes.value(); }
+
+private:
+	size_t _groups() const { return groupStarts.size() - 1; }
+
+	size_t _group(const size_t f) const {
+		return std::upper_bound(groupStarts.begin(), groupStarts.end(), f) - groupStarts.begin() - 1;
+	}
+
+	void _fail(const std::string& message) {
+		std::lock_guard<std::mutex> lock(failureMutex);
+		if (!failed) {
+			failure = message;
+			failed = true;
+		}
+	}
+
+	void _runSerial() {
+		for (size_t block = 0; !failed; ++block) {
+			std::vector<std::shared_ptr<RowSegment>> segments;
+			for (size_t g = 0; g < _groups(); ++g) {
+				auto lines = _readBlock(g, block);
+				if (failed) return;
+				segments.push_back(_parseBlock(lines));
+				if (failed) return;
+			}
+			if (!_writeBlock(segments)) return;
+		}
+	}
+
+	void _runThreaded() {
+		std::atomic<size_t> readersLeft(_groups());
+		std::atomic<size_t> parsersLeft(parsers);
+		auto abort = [&]() { return failed.load(); };
+
+		std::vector<std::thread> threads;
+		for (size_t g = 0; g < _groups(); ++g) {
+			threads.emplace_back([&, g]() {
+				for (size_t block = 0; !failed; ++block) {
+					// Stay within the window of blocks ahead of the writer
+					for (unsigned int spins = 0; block >= blocksWritten + window && !failed; ++spins) {
+						if (spins < 64) std::this_thread::yield();
+						else std::this_thread::sleep_for(std::chrono::microseconds(100));
+					}
+					auto lines = _readBlock(g, block);
+					if (failed) break;
+					const bool last = lines->rows < blockRows;
+					if (!lineQueue.push(lines, abort) || last) break;
+				}
+				--readersLeft;
+			});
+		}
+		for (size_t p = 0; p < parsers; ++p) {
+			threads.emplace_back([&]() {
+				std::shared_ptr<LineBlock> lines;
+				while (!failed && lineQueue.pop(lines, [&]() { return readersLeft == 0 || failed; })) {
+					auto segment = _parseBlock(lines);
+					if (failed || !segmentQueue.push(segment, abort)) break;
+				}
+				--parsersLeft;
+			});
+		}
+
+		// Writer (on the calling thread): puts the segments of each block back together in group order
+		std::map<size_t, std::vector<std::shared_ptr<RowSegment>>> pending;
+		std::shared_ptr<RowSegment> segment;
+		size_t nextBlock = 0;
+		bool done = false;
+		while (!done && !failed && segmentQueue.pop(segment, [&]() { return parsersLeft == 0 || failed; })) {
+			auto& slot = pending[segment->block];
+			slot.resize(_groups());
+			slot[segment->group] = segment;
+			for (auto it = pending.find(nextBlock); it != pending.end(); it = pending.find(nextBlock)) {
+				if (std::any_of(it->second.begin(), it->second.end(), [](const auto& seg) { return !seg; })) break;
+				if (!_writeBlock(it->second)) done = true;
+				pending.erase(it);
+				blocksWritten = ++nextBlock;
+				if (done) break;
+			}
+		}
+		if (!done && !failed) _fail("Merge pipeline stopped before all rows were written. Aborting combination operation.\n");
+		for (auto& thread : threads) thread.join();
+	}
+
+	// Reads up to blockRows lines from every file of group g
+	std::shared_ptr<LineBlock> _readBlock(const size_t g, const size_t block) {
+		auto lines = std::make_shared<LineBlock>();
+		lines->group = g;
+		lines->block = block;
+		const size_t first = groupStarts[g], last = groupStarts[g + 1];
+		std::vector<std::pair<size_t, size_t>> owned; // (line index, storage offset) of copied lines
+		std::string_view line;
+		for (size_t f = first; f < last; ++f) {
+			const size_t expected = (f == first) ? blockRows : lines->rows;
+			if (batch[f].matrix) { // rows of binary inputs are read by the parsers straight from the mapping
+				const uint64_t rowEnd = std::min(batch[f].matrix->rows(), batch[f].firstRow + std::min(batch[f].rowCount, batch[f].matrix->rows()));
+				const uint64_t rowsLeft = rowEnd - std::min<uint64_t>(rowEnd, batch[f].firstRow + block * blockRows);
+				const size_t got = (size_t)std::min<uint64_t>(expected, rowsLeft);
+				if (f == first) {
+					lines->rows = got;
+				}
+				else if (got < lines->rows) {
+					_fail("File " + batch[f].path.string() + " ended prematurely. Aborting combination operation.\n");
+					return lines;
+				}
+				if (lines->rows < blockRows && rowsLeft > lines->rows) {
+					_fail("File " + batch[first].path.string() + " ended prematurely. Aborting combination operation.\n");
+					return lines;
+				}
+				lines->lines.resize(lines->lines.size() + got);
+				continue;
+			}
+			auto& reader = *batch[f].reader;
+			size_t got = 0;
+			for (; got < expected && reader.getline(line); ++got) {
+				if (reader.stableLines()) {
+					lines->lines.push_back(line);
+				}
+				else {
+					owned.emplace_back(lines->lines.size(), lines->storage.size());
+					lines->storage.append(line);
+					lines->lines.emplace_back(nullptr, line.size());
+				}
+			}
+			if (got < expected && !reader.error().empty()) {
+				_fail("File " + batch[f].path.string() + " could not be read (" + reader.error() + "). Aborting combination operation.\n");
+				return lines;
+			}
+			if (f == first) {
+				lines->rows = got;
+			}
+			else if (got < lines->rows) {
+				_fail("File " + batch[f].path.string() + " ended prematurely. Aborting combination operation.\n");
+				return lines;
+			}
+			if (lines->rows < blockRows && reader.getline(line)) { // the group's first file ended
+				_fail("File " + batch[first].path.string() + " ended prematurely. Aborting combination operation.\n");
+				return lines;
+			}
+		}
+		for (auto& [index, offset] : owned) lines->lines[index] = std::string_view(lines->storage.data() + offset, lines->lines[index].size());
+		return lines;
+	}
+
+	// Splits the lines of a block, checks gene names against the group's first file and formats the group's cells
+	std::shared_ptr<RowSegment> _parseBlock(const std::shared_ptr<LineBlock>& lines) {
+		auto segment = std::make_shared<RowSegment>();
+		segment->group = lines->group;
+		segment->block = lines->block;
+		segment->rows = lines->rows;
+		segment->lines = lines;
+		segment->genes.resize(lines->rows);
+		segment->rowEnds.reserve(lines->rows);
+		const size_t first = groupStarts[lines->group], last = groupStarts[lines->group + 1];
+		for (size_t f = first; f < last; ++f) segment->cols += batch[f].columns.size();
+		if (cellFormat == CellFormat::numeric) segment->values.reserve(segment->cols * lines->rows);
+		std::vector<std::string_view> fileLineSplitVec;
+
+		// Binary inputs: copy this block's values out of the mapped column blocks in one go
+		const uint64_t blockRow = (uint64_t)lines->block * blockRows; // within the rows merged from each file
+		std::vector<std::vector<double>> binValues(last - first);
+		for (size_t f = first; f < last; ++f) {
+			if (!batch[f].matrix) continue;
+			std::vector<uint64_t> columns;
+			for (auto& col : batch[f].columns) columns.push_back(col.colnum);
+			binValues[f - first].resize(lines->rows * columns.size());
+			batch[f].matrix->copyRows(batch[f].firstRow + blockRow, lines->rows, columns, binValues[f - first].data());
+		}
+
+		for (size_t r = 0; r < lines->rows; ++r) {
+			for (size_t f = first; f < last; ++f) {
+				auto& file = batch[f];
+				if (file.matrix) {
+					if (!_parseBinRow(*segment, file, f == first, file.firstRow + blockRow + r, r, binValues[f - first])) return segment;
+					continue;
+				}
+				const std::string_view fileLine = lines->lines[(f - first) * lines->rows + r];
+
+				// A tab file fully read before, with all its runs wanted as text: pass everything after the gene name on
+				if (wholeLine[f] && cellFormat == CellFormat::text) {
+					const size_t tab = std::min(fileLine.find('\t'), fileLine.size());
+					if (f == first) segment->genes[r] = fileLine.substr(0, tab);
+					segment->text.append(fileLine.substr(tab));
+					continue;
+				}
 
 				// Split line
-				if (file.filetype == FileType::Salmon) splitLineOnTabs(fileLine, fileLineSplitVec, 5);
-				else splitLineOnTabs(fileLine, fileLineSplitVec, file.columns.size());
-
-				// If it's not the header, write/check gene names
-				if (!header) {
-					if (firstfileofline) { // If it's the first file of the line write gene names in first column
-						genename = fileLineSplitVec.at(0);
-						if ((specialmode != RunnerOutput::printruns) && (specialmode != RunnerOutput::none)) out << genename;
+				splitLineOnTabs(fileLine, fileLineSplitVec, lastField[f] + 1);
+				if (!file.columns.size() || fileLineSplitVec.size() <= lastField[f]) {
+					_fail("File " + file.path.string() + " has a truncated line. Aborting combination operation.\n");
+					return segment;
+				}
+
+				// Record the gene name of the group's first file and check the others against it
+				const std::string_view gene = fileLineSplitVec[file.idColumn];
+				if (f == first) {
+					segment->genes[r] = gene;
+				}
+				else if (!knownOrder[f] && segment->genes[r] != gene) {
+					_fail("Gene name mismatch in file " + file.path.string() + ". Expected gene " + std::string(segment->genes[r]) + " but read gene " + std::string(gene) + "\n");
+					return segment;
+				}
+
+				// copy non-gene data
+				std::string error;
+				if (!_addCells(*segment, r, fileLineSplitVec, file, cellFormat, numbers, error)) {
+					_fail(error);
+					return segment;
+				}
+			}
+			segment->rowEnds.push_back(segment->text.size());
+		}
+		return segment;
+	}
+
+	// Adds row r of the block from a binary input; values holds the file's converted values for the block
+	bool _parseBinRow(RowSegment& segment, const InputFileData& file, const bool firstOfGroup, const uint64_t row, const size_t r, const std::vector<double>& values) {
+		const std::string_view gene = file.matrix->genes[row];
+		if (firstOfGroup) {
+			segment.genes[r] = gene;
+		}
+		else if (!knownOrder[&file - batch.data()] && segment.genes[r] != gene) {
+			_fail("Gene name mismatch in file " + file.path.string() + ". Expected gene " + std::string(segment.genes[r]) + " but read gene " + std::string(gene) + "\n");
+			return false;
+		}
+		const size_t ncols = file.columns.size();
+		const double* rowValues = values.data() + r * ncols;
+		if (cellFormat == CellFormat::text) {
+			for (size_t c = 0; c < ncols; ++c) {
+				segment.text.push_back('\t');
+				_appendNumber(segment.text, rowValues[c], file.matrix->dtype(), numbers);
+			}
+		}
+		else if (cellFormat == CellFormat::numeric) {
+			segment.values.insert(segment.values.end(), rowValues, rowValues + ncols);
+		}
+		return true;
+	}
+
+	// Checks gene names across groups and writes the rows of one block; returns false after the last block
+	bool _writeBlock(const std::vector<std::shared_ptr<RowSegment>>& segments) {
+		const size_t rows = segments.front()->rows;
+		for (size_t g = 1; g < segments.size(); ++g) {
+			if (segments[g]->rows != rows) {
+				const size_t shorter = (segments[g]->rows < rows) ? g : 0;
+				_fail("File " + batch[groupStarts[shorter]].path.string() + " ended prematurely. Aborting combination operation.\n");
+				return false;
+			}
+		}
+		for (size_t r = 0; r < rows; ++r) {
+			const std::string_view genename = segments.front()->genes[r];
+			for (size_t g = 1; g < segments.size() && !sameGroupOrder; ++g) {
+				if (segments[g]->genes[r] != genename) {
+					_fail("Gene name mismatch in file " + batch[groupStarts[g]].path.string() + ". Expected gene " + std::string(genename) + " but read gene " + std::string(segments[g]->genes[r]) + "\n");
+					return false;
+				}
+			}
+			genes.add(genename);
+		}
+		sink.rows(segments);
+		rowsWritten += rows;
+		if (progress) std::cout << "\rProcessed gene " << rowsWritten << ".";
+		return rows == blockRows;
+	}
+
+	std::vector<InputFileData>& batch;
+	MatrixSink& sink;
+	const CellFormat cellFormat;
+	const NumberFormat numbers;
+	const bool progress;
+	std::vector<size_t> groupStarts;
+	std::vector<bool> knownOrder; // per file: same gene order as the group's first file, so names are not compared
+	std::vector<bool> wholeLine; // per file: tab file whose lines can be passed on after the gene name untouched
+	std::vector<size_t> lastField; // per file: last field a line must have
+	bool sameGroupOrder = false;
+	size_t parsers = 1;
+	bool threaded = false;
+
+	BoundedQueue<std::shared_ptr<LineBlock>> lineQueue;
+	BoundedQueue<std::shared_ptr<RowSegment>> segmentQueue;
+	std::atomic<size_t> blocksWritten{ 0 };
+	size_t rowsWritten = 0;
+	GeneFingerprint genes;
+
+	std::atomic<bool> failed{ false };
+	std::mutex failureMutex;
+	std::string failure;
+};
+
+// Joins one batch of files on gene name, for inputs whose gene order or gene set differ. Every file is mapped and
+// indexed by row in parallel, then a dictionary gives each gene a slot, in order of first appearance across the
+// batch. The output rows are the slots present in every file (inner join) or in any file (outer join, with the
+// missing cells filled in), formatted in parallel a window of blocks at a time and handed to the sink in order.
+// Memory grows with the rows of the batch's files, which is why join batches are capped at inMemoryFanIn files.
+class BatchJoin {
+public:
+	static constexpr size_t blockRows = 1024;
+
+	BatchJoin(std::vector<InputFileData>& files, MatrixSink& output, const unsigned int threads, const bool showProgress)
+		: batch(files), sink(output), cellFormat(output.cells()), numbers(output.numbers()), workers(std::max(1u, threads)), progress(showProgress),
+		indexes(files.size()) {}
+
+	// Runs the join into rows written; false (with the reason reported) if it failed
+	bool run(size_t& rows) {
+		rows = 0;
+		const bool numericFill = _parseCell(joinFill, fillValue);
+		if ((cellFormat == CellFormat::numeric || !numbers.verbatim()) && !numericFill) {
+			std::cerr << "Fill value '" << joinFill << "' is not a number. Aborting combination operation.\n";
+			return false;
+		}
+		fillText.clear();
+		_appendCell(fillText, joinFill, numbers);
+		parallelFor(batch.size(), workers, [&](size_t f) { _indexFile(f); });
+		if (!failed) _buildDictionary();
+		if (!failed) _writeRows();
+		rows = rowsWritten;
+		if (failed) std::cerr << failure;
+		return !failed;
+	}
+
+	uint64_t geneFingerprint() const { return genes.value(); }
+
+private:
+	static constexpr uint32_t absent = UINT32_MAX;
+
+	struct FileIndex {
+		std::shared_ptr<MappedFile> mapped;
+		std::string inflated; // whole text of a compressed input
+		std::vector<std::string_view> lines; // data line of each row (text inputs)
+		std::vector<std::string_view> genes; // gene name of each row
+		std::vector<uint32_t> rowOfSlot; // row of each dictionary slot, or absent
+	};
+
+	void _fail(const std::string& message) {
+		std::lock_guard<std::mutex> lock(failureMutex);
+		if (!failed) {
+			failure = message;
+			failed = true;
+		}
+	}
+
+	void _indexFile(const size_t f) {
+		auto& file = batch[f];
+		auto& index = indexes[f];
+		if (file.filetype == FileType::Bin) {
+			file.matrix = std::make_shared<RnabinFile>();
+			std::string error;
+			if (!file.matrix->open(file.path, error)) {
+				_fail("File " + file.path.string() + " could not be read as an RNA-see binary file (" + error + ").\n");
+				return;
+			}
+			index.genes = file.matrix->genes;
+			return;
+		}
+		std::string_view text;
+		if (isGzipPath(file.path)) {
+			if (!inflateFile(file.path, index.inflated)) {
+				_fail("File " + file.path.string() + " failed to open or is not valid gzip data.\n");
+				return;
+			}
+			text = index.inflated;
+		}
+		else {
+			index.mapped = std::make_shared<MappedFile>();
+			if (!index.mapped->open(file.path)) {
+				_fail("File " + file.path.string() + " failed to open.\n");
+				return;
+			}
+			text = index.mapped->view();
+		}
+		MappedLineReader reader(text);
+		std::string_view line;
+		if (file.hasHeader && !reader.getline(line)) {
+			_fail("File " + file.path.string() + " ended prematurely. Aborting combination operation.\n");
+			return;
+		}
+		std::vector<std::string_view> fields;
+		while (reader.getline(line)) {
+			if (line.empty()) continue;
+			index.lines.push_back(line);
+			if (!file.idColumn) {
+				index.genes.push_back(line.substr(0, std::min(line.find('\t'), line.size())));
+				continue;
+			}
+			splitLineOnTabs(line, fields, file.idColumn + 1);
+			if (fields.size() <= file.idColumn) {
+				_fail("File " + file.path.string() + " has a truncated line. Aborting combination operation.\n");
+				return;
+			}
+			index.genes.push_back(fields[file.idColumn]);
+		}
+	}
+
+	void _buildDictionary() {
+		std::unordered_map<std::string_view, uint32_t> dictionary;
+		std::vector<std::string_view> slotGenes;
+		std::vector<uint32_t> slotFiles; // number of files holding each slot
+		std::vector<std::vector<uint32_t>> slotOfRow(batch.size());
+		for (size_t f = 0; f < batch.size(); ++f) {
+			auto& rowGenes = indexes[f].genes;
+			slotOfRow[f].reserve(rowGenes.size());
+			for (auto& gene : rowGenes) {
+				const auto inserted = dictionary.emplace(gene, (uint32_t)slotGenes.size());
+				const uint32_t slot = inserted.first->second;
+				if (inserted.second) {
+					slotGenes.push_back(gene);
+					slotFiles.push_back(0);
+				}
+				slotOfRow[f].push_back(slot);
+				++slotFiles[slot];
+			}
+		}
+
+		parallelFor(batch.size(), workers, [&](size_t f) {
+			auto& rowOfSlot = indexes[f].rowOfSlot;
+			rowOfSlot.assign(slotGenes.size(), absent);
+			for (uint32_t row = 0; row < slotOfRow[f].size(); ++row) {
+				const uint32_t slot = slotOfRow[f][row];
+				if (rowOfSlot[slot] != absent) {
+					_fail("Gene " + std::string(slotGenes[slot]) + " appears more than once in file " + batch[f].path.string() + ". Aborting combination operation.\n");
+					return;
+				}
+				rowOfSlot[slot] = row;
+			}
+			std::vector<uint32_t>().swap(slotOfRow[f]);
+		});
+
+		for (uint32_t slot = 0; slot < slotGenes.size(); ++slot) {
+			if (joinMode == JoinMode::outer || slotFiles[slot] == batch.size()) outSlots.push_back(slot);
+		}
+		outGenes = std::move(slotGenes);
+		if (progress) {
+			std::cout << "Joining " << outSlots.size() << " genes (" << outGenes.size() << " distinct gene names in " << batch.size() << " files).\n";
+		}
+	}
+
+	std::shared_ptr<RowSegment> _formatBlock(const size_t block) {
+		auto segment = std::make_shared<RowSegment>();
+		segment->block = block;
+		const size_t first = block * blockRows;
+		segment->rows = std::min(blockRows, outSlots.size() - first);
+		for (auto& file : batch) segment->cols += file.columns.size();
+		segment->genes.resize(segment->rows);
+		segment->rowEnds.reserve(segment->rows);
+		if (cellFormat == CellFormat::numeric) segment->values.reserve(segment->cols * segment->rows);
+		std::vector<std::string_view> tokens;
+		for (size_t r = 0; r < segment->rows; ++r) {
+			const uint32_t slot = outSlots[first + r];
+			segment->genes[r] = outGenes[slot];
+			for (size_t f = 0; f < batch.size(); ++f) {
+				auto& file = batch[f];
+				const uint32_t row = indexes[f].rowOfSlot[slot];
+				if (row == absent) {
+					for (size_t c = 0; c < file.columns.size(); ++c) {
+						if (cellFormat == CellFormat::text) {
+							segment->text.append(fillText);
+						}
+						else if (cellFormat == CellFormat::numeric) {
+							segment->values.push_back(fillValue);
+						}
 					}
-					else if (genename != fileLineSplitVec.at(0)) { // If it's not the first file, check that gene names match at least
-						std::cerr << "Gene name mismatch in file " << file.path << ". Expected gene " << genename << " but read gene " << fileLineSplitVec.at(0) << "\n";
-						exit(1);
+					continue;
+				}
+				if (file.matrix) {
+					for (auto& col : file.columns) {
+						const double value = file.matrix->value(row, col.colnum);
+						if (cellFormat == CellFormat::text) {
+							segment->text.push_back('\t');
+							_appendNumber(segment->text, value, file.matrix->dtype(), numbers);
+						}
+						else if (cellFormat == CellFormat::numeric) {
+							segment->values.push_back(value);
+						}
 					}
+					continue;
+				}
+				splitLineOnTabs(indexes[f].lines[row], tokens, _lastField(file) + 1);
+				if (!file.columns.size() || tokens.size() <= _lastField(file)) {
+					_fail("File " + file.path.string() + " has a truncated line. Aborting combination operation.\n");
+					return segment;
+				}
+				std::string error;
+				if (!_addCells(*segment, r, tokens, file, cellFormat, numbers, error)) {
+					_fail(error);
+					return segment;
 				}
+			}
+			segment->rowEnds.push_back(segment->text.size());
+		}
+		return segment;
+	}
+
+	void _writeRows() {
+		const size_t blocks = (outSlots.size() + blockRows - 1) / blockRows;
+		const size_t window = std::max<size_t>(1, workers);
+		std::vector<std::shared_ptr<RowSegment>> formatted(window);
+		for (size_t start = 0; start < blocks && !failed; start += window) {
+			const size_t count = std::min(window, blocks - start);
+			parallelFor(count, workers, [&](size_t i) { formatted[i] = _formatBlock(start + i); });
+			for (size_t i = 0; i < count && !failed; ++i) {
+				for (auto& gene : formatted[i]->genes) genes.add(gene);
+				sink.rows({ formatted[i] });
+				rowsWritten += formatted[i]->rows;
+				formatted[i].reset();
+				if (progress) std::cout << "\rProcessed gene " << rowsWritten << ".";
+			}
+		}
+	}
+
+	std::vector<InputFileData>& batch;
+	MatrixSink& sink;
+	const CellFormat cellFormat;
+	const NumberFormat numbers;
+	const unsigned int workers;
+	const bool progress;
+	double fillValue = 0;
+	std::string fillText; // fill cell of text output, with its tab
+
+	std::vector<FileIndex> indexes;
+	std::vector<uint32_t> outSlots; // dictionary slots of the output rows, in order
+	std::vector<std::string_view> outGenes; // gene name of each slot
+	size_t rowsWritten = 0;
+	GeneFingerprint genes;
+
+	std::atomic<bool> failed{ false };
+	std::mutex failureMutex;
+	std::string failure;
+};
+
+// Merges one batch of files into outFilePaths, one per selected quantity (or a single path if only one quantity is
+// merged); returns the fingerprint of the gene order written, or nothing if the merge failed (the reason is reported,
+// and outputs may be left partly written for the caller to remove)
+std::optional<uint64_t> _mergeFilesBatch(std::vector<InputFileData>& batch, const std::vector<std::string>& outFilePaths, const FileType /*filetype*/,
+	RunnerOutput specialmode, const OutputOptions& output = OutputOptions(), const unsigned int threads = workerThreads, const bool progress = true) {
+
+	try {
+
+		// Open input files and identify file types (a join maps and indexes them itself)
+		for (auto& file : batch) {
+			if (joinMode != JoinMode::none) break;
+			if (file.filetype == FileType::Bin) {
+				file.matrix = std::make_shared<RnabinFile>();
+				std::string error;
+				if (!file.matrix->open(file.path, error)) {
+					std::cerr << "File " << file.path << " could not be read as an RNA-see binary file (" << error << ").\n";
+					return std::nullopt;
+				}
+				if (!file.geneFingerprint) { // the gene dictionary is at hand, so its fingerprint is cheap
+					GeneFingerprint genes;
+					for (auto& gene : file.matrix->genes) genes.add(gene);
+					file.geneFingerprint = genes.value();
+				}
+				continue;
+			}
+			const bool wholeFile = !file.firstRow && file.rowCount == UINT64_MAX;
+			file.reader = wholeFile ? openLineReader(file.path, inputReaderMode) : openLineRange(file.path, file.hasHeader, file.firstRow, file.rowCount, file.lineIndex);
+			if (!file.reader) {
+				std::cerr << "File " << file.path << " failed to open.\n";
+				std::cerr << "You may be trying to combine more files than your operating system can simultaneously open.\n";
+				return std::nullopt;
+			}
+		}
+
+		// Header line: checked files already know their runs, so it only has to be skipped in the inputs
+		std::string_view headerLine;
+		std::vector<std::string> runs;
+		for (auto& file : batch) {
+			if (file.reader && file.hasHeader && !file.reader->getline(headerLine)) {
+				std::cerr << "File " << file.path << " ended prematurely. Aborting combination operation.\n";
+				return std::nullopt;
+			}
+			if (file.filetype == FileType::Tab) file.fieldCount = 1 + std::count(headerLine.begin(), headerLine.end(), '\t');
+			for (auto& col : file.columns) runs.push_back(col.runname);
+		}
+
+		// Open and prep output file(s)
+		const std::string& outFilePath = outFilePaths.front();
+		std::unique_ptr<MatrixSink> sink;
+		if (outFilePaths.size() > 1) {
+			std::vector<std::unique_ptr<MatrixSink>> sinks;
+			for (size_t q = 0; q < outFilePaths.size(); ++q) sinks.push_back(_makeSink(specialmode, output));
+			std::vector<size_t> columnQuantities;
+			for (auto& file : batch) {
+				for (auto& col : file.columns) columnQuantities.push_back(col.quantity);
+			}
+			sink = std::make_unique<QuantitySplitSink>(std::move(sinks), outFilePaths, std::move(columnQuantities));
+		}
+		else {
+			sink = _makeSink(specialmode, output);
+		}
+		GeneAggregateSink* aggregate = nullptr;
+		if (output.tx2gene && specialmode != RunnerOutput::printruns) {
+			auto aggregating = std::make_unique<GeneAggregateSink>(std::move(sink), output.tx2gene);
+			aggregate = aggregating.get();
+			sink = std::move(aggregating);
+		}
+		if (!sink->open(outFilePath, runs)) {
+			std::cerr << "Failed to open output file " << outFilePath << "\n";
+			return std::nullopt;
+		}
+
+		// Merge the gene rows
+		uint64_t fingerprint;
+		size_t rows = 0;
+		bool merged;
+		std::unique_ptr<BatchJoin> join;
+		std::unique_ptr<BatchMergePipeline> pipeline;
+		if (joinMode != JoinMode::none) {
+			join = std::make_unique<BatchJoin>(batch, *sink, threads, progress);
+			merged = join->run(rows);
+			fingerprint = join->geneFingerprint();
+		}
+		else {
+			pipeline = std::make_unique<BatchMergePipeline>(batch, *sink, threads, progress);
+			merged = pipeline->run(rows);
+			fingerprint = pipeline->geneFingerprint();
+		}
+		if (merged && progress) std::cout << "\rProcessed gene " << rows << ".\n";
+
+		// Clean up, after a failure too. The sink finishes first: rows it is still writing may point into the inputs
+		// and the join's indexes.
+		const bool finished = sink->finish();
+		if (!merged) return std::nullopt;
+		if (!finished) {
+			std::cerr << "Failed to write output file " << outFilePath << "\n";
+			return std::nullopt;
+		}
+		join.reset();
+		pipeline.reset();
+		for (auto& file : batch) {
+			file.reader.reset();
+			file.matrix.reset();
+		}
+		return aggregate ? aggregate->geneFingerprint() : fingerprint;
+	}
+	catch (...) {
+		std::cerr << "Unknown merge error.\n";
+		return std::nullopt;
+	}
+}
 
-				// copy non-gene data
+// Number of input files a single merge may hold open
+size_t _mergeFanIn() {
+	const bool inMemory = joinMode != JoinMode::none || finalOutput.tx2gene;
+	const size_t fanIn = inMemory ? std::min<size_t>(inMemoryFanIn, fileSystemMaxFilesOpen) : fileSystemMaxFilesOpen;
+	return std::max<size_t>(2, fanIn);
+}
 
-				if (file.filetype == FileType::Salmon) {
-					if ((specialmode != RunnerOutput::printgenes) && (specialmode != RunnerOutput::none)) {
-						if (header) {
-							if (specialmode == RunnerOutput::printruns) {
-								out << file.path.stem() << '\n'; // For Salmon files, write file name as run names in header
-							}
-							else {
-								out << '\t' << file.path.stem(); // For Salmon files, write file name as run names in header
-							}
-						}
-						else {
-							if (specialmode != RunnerOutput::printruns) {
-								out << '\t' << fileLineSplitVec.at(3); // If not header, copy data
-							}
-						}
-					}
-				}
-				else if (file.filetype == FileType::Tab) { // For tab files, copy run names
-					if (!file.columns.size() || fileLineSplitVec.size() < (--file.columns.end())->colnum) {
-						std::cerr << "File " << file.path << " ended prematurely. Aborting combination operation.\n";
-						exit(1);
-					}
-					for (auto& col : file.columns) {
-						if ((specialmode != RunnerOutput::printgenes) && (specialmode != RunnerOutput::none)) {
-							if (specialmode == RunnerOutput::printruns) {
-								if (header) {
-									out << fileLineSplitVec.at(col.colnum) << '\n';
-								}
-							}
-							else {
-								out << '\t' << fileLineSplitVec.at(col.colnum);
-							}
-						}
-					}
+// Removes files of the merge tree that are temporary, whether or not they were (all) written
+void _removeFiles(const std::vector<InputFileData>& files) {
+	std::error_code ec;
+	for (auto& file : files) std::filesystem::remove(file.path, ec);
+}
 
-				}
-				firstfileofline = false; // Declare no longer first file of line
-			}
-			if (!header || (specialmode == RunnerOutput::normal)) {
-				if (!eof) out << '\n'; // Terminate line
+// Merges one level of the merge tree: the files are split into `groups` contiguous column groups, and each group is
+// merged into a temporary file (checking gene names within the group), or into one temporary file per selected
+// quantity if `quantityCount` is above 1. Groups run concurrently, as many at a time as fit within fanIn open files.
+// Inputs that are themselves temporary files are deleted as soon as their group is merged. Sets grouptempfiles to the
+// temporary files of each quantity, in column order, and returns whether all of them were merged and checked; once a
+// group fails, the groups not yet started are skipped.
+bool _mergeLevel(std::vector<InputFileData>& infiles, const std::string& tempprefix, size_t groups, const size_t fanIn,
+	const bool deleteInputs, const FileType filetype, const size_t quantityCount, std::vector<std::vector<InputFileData>>& grouptempfiles) {
+	const size_t numfiles = infiles.size();
+	const size_t groupSize = (numfiles + groups - 1) / groups;
+	groups = (numfiles + groupSize - 1) / groupSize; // rounding the group size up can leave trailing groups empty
+	const size_t concurrent = std::max<size_t>(1, std::min<size_t>({ (size_t)workerThreads, groups, fanIn / groupSize }));
+	const unsigned int threadsPerGroup = std::max(1u, workerThreads / (unsigned int)concurrent);
+
+	const OutputOptions tempOutput = _intermediateOutput(!deleteInputs); // inputs that are not temporary files are the originals
+	const FileType tempType = (tempOutput.format == OutputFormat::rnabin) ? FileType::Bin : FileType::Tab;
+	grouptempfiles.assign(quantityCount, std::vector<InputFileData>(groups));
+	for (size_t q = 0; q < quantityCount; ++q) {
+		for (size_t i = 0; i < groups; ++i) {
+			std::string path = tempprefix + std::to_string(i);
+			if (quantityCount > 1) path += "_" + salmonColumns[quantities[q]];
+			grouptempfiles[q][i].path.assign(path);
+			grouptempfiles[q][i].filetype = tempType;
+		}
+	}
+
+	std::cout << "Merging " << numfiles << " files in " << groups << " column groups (" << concurrent << " at a time).\n";
+	std::mutex progressMutex;
+	size_t groupsDone = 0;
+	std::atomic<bool> failed{ false };
+	parallelFor(groups, (unsigned int)concurrent, [&](size_t i) {
+		if (failed) return;
+		const size_t start = std::min(numfiles, i * groupSize);
+		const size_t end = std::min(numfiles, start + groupSize);
+		std::vector<InputFileData> filebatch(infiles.begin() + start, infiles.begin() + end);
+		std::vector<std::string> temppaths;
+		for (auto& quantityfiles : grouptempfiles) temppaths.push_back(quantityfiles[i].path.string());
+		const auto fingerprint = _mergeFilesBatch(filebatch, temppaths, filetype, RunnerOutput::normal, tempOutput, threadsPerGroup, false);
+		if (!fingerprint) {
+			failed = true;
+			return;
+		}
+		for (auto& quantityfiles : grouptempfiles) quantityfiles[i].geneFingerprint = *fingerprint;
+		if (deleteInputs) _removeFiles(filebatch);
+		std::lock_guard<std::mutex> lock(progressMutex);
+		std::cout << "Merged column group " << ++groupsDone << " (of " << groups << ").\n";
+	});
+	if (failed) return false;
+
+	for (auto& quantityfiles : grouptempfiles) {
+		for (auto& file : quantityfiles) {
+			if (!((tempType == FileType::Bin) ? _checkBinFile(file) : _checkTabFile(file))) {
+				std::cerr << "Temporary file " << file.path << " could not be read back. Aborting combination operation.\n";
+				return false;
 			}
-			header = false; // Declare no longer the header
-			if (!(lineNo % 1000)) std::cout << "\rProcessed gene " << lineNo << ".";
-			lineNo++;
 		}
+	}
+	return true;
+}
 
-		std::cout << "\rProcessed gene " << lineNo << ".\n";
+// Output file of each selected quantity: the output itself for a single quantity, else the output with the
+// quantity's column name inserted before its extension
+std::vector<std::string> _quantityOutputs(const std::string& outfile) {
+	if (quantities.size() == 1) return { outfile };
+	const std::filesystem::path path(outfile);
+	std::vector<std::string> outputs;
+	for (auto quantity : quantities) {
+		std::filesystem::path quantityPath = path;
+		quantityPath.replace_filename(path.stem().string() + "." + salmonColumns[quantity] + path.extension().string());
+		outputs.push_back(quantityPath.string());
+	}
+	return outputs;
+}
 
-		// Clean up
-		for (auto& file : batch) {
-			file.stream->close();
+// Runs the merge tree from the given level on, into one output per selected quantity. Once a level has split the
+// quantities into separate temporary files, each quantity goes on through a tree of its own. Returns false if a
+// merge failed, after removing every temporary file the tree still holds.
+bool _mergeTree(std::vector<InputFileData> levelfiles, const std::vector<std::string>& outputs, size_t level, const FileType filetype,
+	RunnerOutput specialmode) {
+	const size_t fanIn = _mergeFanIn();
+	while (levelfiles.size() > fanIn || (level == 0 && columnGroups > 1 && levelfiles.size() > 1)) {
+		// Levels still needed (including the final merge), and the balanced fan-in that needs no more than that
+		const size_t n = levelfiles.size();
+		size_t levels = 1;
+		for (size_t capacity = fanIn; capacity < n; capacity *= fanIn) ++levels;
+		size_t balanced = std::max<size_t>(2, (size_t)std::ceil(std::pow((double)n, 1.0 / (double)levels)));
+		while (balanced < fanIn) {
+			size_t capacity = 1;
+			for (size_t l = 0; l < levels && capacity < n; ++l) capacity *= balanced;
+			if (capacity >= n) break;
+			++balanced;
 		}
-		if (specialmode != RunnerOutput::none) {
-			out.close();
+		size_t groups = (n + balanced - 1) / balanced;
+		if (level == 0) groups = std::max<size_t>(groups, columnGroups);
+		groups = std::min(groups, n);
+
+		std::cout << "Merge level " << (level + 1) << ": ";
+		std::vector<std::vector<InputFileData>> quantityfiles;
+		if (!_mergeLevel(levelfiles, outputs.front() + "_temp_L" + std::to_string(level) + "_", groups, fanIn, level > 0, filetype, outputs.size(), quantityfiles)) {
+			for (auto& files : quantityfiles) _removeFiles(files);
+			if (level) _removeFiles(levelfiles);
+			return false;
+		}
+		++level;
+		if (quantityfiles.size() > 1) {
+			bool merged = true;
+			for (size_t q = 0; q < quantityfiles.size(); ++q) {
+				if (merged) merged = _mergeTree(quantityfiles[q], { outputs[q] }, level, filetype, specialmode);
+				else _removeFiles(quantityfiles[q]);
+			}
+			return merged;
 		}
+		levelfiles = std::move(quantityfiles.front());
 	}
-	catch (...) {
-		std::cerr << "Unknown merge error.\n";
-		exit(1);
+
+	const char* outputKind = (finalOutput.format == OutputFormat::rnabin) ? "RNA-see binary"
+		: (finalOutput.format == OutputFormat::mtx) ? "MatrixMarket" : (finalOutput.format == OutputFormat::csc) ? "RNA-see sparse" : "RNA-see tab";
+	for (auto& outfile : outputs) {
+		if (level) std::cout << "Stitching " << levelfiles.size() << " column groups into " << outputKind << " output file " << outfile << ".\n";
+		else std::cout << "Merging " << levelfiles.size() << " input files into " << outputKind << " output file " << outfile << ".\n";
 	}
+	OutputOptions output = finalOutput;
+	if (level) { // already aggregated (and text rewritten) by the first level
+		output.tx2gene.reset();
+		if (finalOutput.format == OutputFormat::rnatab) output.numbers = NumberFormat();
+	}
+	const bool merged = _mergeFilesBatch(levelfiles, outputs, filetype, specialmode, output).has_value();
+	if (level) _removeFiles(levelfiles);
+	return merged;
+}
+
+// Restricts the inputs to this process's shard of the gene rows. All inputs have the same rows (in the same order),
+// so the rows are counted in the first input only; the last shard reads on to the end of every file, so that files
+// longer than the first are still caught. The line indexes of plain text inputs (see LineIndex) are extended up to
+// the end of the slice, so each file is only read as far as this shard needs (the first input in full, to count
+// its rows), and a later run of the shard, whose manifest keeps the indexes, finds the slice from the nearest
+// sampled offset.
+void _selectShard(std::vector<InputFileData>& infiles) {
+	InputFileData& first = infiles.front();
+	uint64_t rows = 0;
+	if (first.filetype == FileType::Bin) {
+		RnabinFile matrix;
+		std::string error;
+		if (!matrix.open(first.path, error)) {
+			std::cerr << "File " << first.path << " could not be read as an RNA-see binary file (" << error << ").\n";
+			exit(1);
+		}
+		rows = matrix.rows();
+	}
+	else {
+		if (extendLineIndex(first.path, first.lineIndex, UINT64_MAX)) rows = first.lineIndex.lines;
+		else if (!countLines(first.path, rows)) { // gzip inputs are not indexed
+			std::cerr << "File " << first.path << " could not be read.\n";
+			exit(1);
+		}
+		if (first.hasHeader && rows) --rows;
+	}
+	const uint64_t begin = rows * shard.index / shard.count, end = rows * (shard.index + 1) / shard.count;
+	std::cout << "Shard " << shard.index << "/" << shard.count << ": merging gene rows " << begin << " to " << end << " (of " << rows << ").\n";
+	parallelFor(infiles.size(), workerThreads, [&](size_t i) {
+		auto& file = infiles[i];
+		file.firstRow = begin;
+		file.rowCount = (shard.index + 1 == shard.count) ? UINT64_MAX : end - begin;
+		if (file.filetype != FileType::Bin) extendLineIndex(file.path, file.lineIndex, (file.hasHeader ? 1 : 0) + end);
+	});
 }
 
-// Merges the specified .tab or .sf files, assuming that .sf files are named after runs
-void _mergeFiles(std::vector<InputFileData>& infiles, const std::string& outfile, bool overwrite, const FileType filetype,
+// Merges the specified .rnatab, .rnabin or .sf files, assuming that .sf files are named after runs.
+// If there are more files than one merge can hold open, they are merged as a tree: each level merges column groups
+// into temporary files, with the fan-in balanced so the tree is no deeper than needed, until the remaining files
+// can be stitched together into the output in one final merge. If several Salmon quantities are selected, they are
+// read in the same pass and written to one output each (see _quantityOutputs). Returns false if the merge failed.
+bool _mergeFiles(std::vector<InputFileData>& infiles, const std::string& outfile, bool overwrite, const FileType filetype,
 	RunnerOutput specialmode) {
 	const size_t numfiles = infiles.size();
 	if (numfiles < 1) {
@@ -326,15 +1832,20 @@ void _mergeFiles(std::vector<InputFileData>& infiles, const std::string& outfile
 		exit(1);
 	}
 
-	size_t maxCombine = fileSystemMaxFilesOpen * fileSystemMaxFilesOpen;
-	if (numfiles > maxCombine) {
-		std::cerr << "Trying to combine too many files (can combine " << maxCombine << " files but tried to combine " << infiles.size() << ").\n";
-		exit(1);
+	const std::vector<std::string> outputs = (specialmode == RunnerOutput::normal) ? _quantityOutputs(outfile) : std::vector<std::string>{ outfile };
+	for (auto& output : outputs) {
+		if (std::filesystem::exists(output) && !overwrite) {
+			std::cerr << "Output file already exists\n";
+			exit(1);
+		}
 	}
-
-	if (std::filesystem::exists(outfile) && !overwrite) {
-		std::cerr << "Output file already exists\n";
-		exit(1);
+	if (outputs.size() > 1) {
+		for (auto& file : infiles) {
+			if (file.filetype != FileType::Salmon && file.filetype != FileType::Kallisto) {
+				std::cerr << "File " << file.path << " holds a single quantity, so it cannot be merged into several quantity matrices.\n";
+				exit(1);
+			}
+		}
 	}
 
 	// Check if you have duplicate file names
@@ -348,37 +1859,8 @@ void _mergeFiles(std::vector<InputFileData>& infiles, const std::string& outfile
 		filesAdded.insert(nextPath);
 	}
 
-	// divide into merge batches if required
-	int batches = (((int)numfiles + fileSystemMaxFilesOpen - 1) / fileSystemMaxFilesOpen);
-
-	if (batches > 1) {
-		std::vector<InputFileData> batchtempfiles;
-		for (int i = 0; i < batches; ++i) {
-			auto start_range = infiles.begin() + i * fileSystemMaxFilesOpen;
-			auto end_range = infiles.end() - 1;
-			if (i < (batches - 1)) {
-				end_range = infiles.begin() + ((i + 1) * fileSystemMaxFilesOpen) - 1;
-			}
-			std::vector<InputFileData> filebatch;
-			while (start_range <= end_range) {
-				filebatch.push_back(*start_range);
-				start_range++;
-			}
-			std::string batchfile = outfile + "_temp_batch" + std::to_string(i);
-			batchtempfiles.push_back(InputFileData());
-			batchtempfiles.back().path.assign(batchfile);
-			batchtempfiles.back().filetype = FileType::Tab;
-			std::cout << "Merging batch " << (i + 1) << " (of " << batches << ").\n";
-			//_mergeFiles(filebatch, batchfile, overwrite, filetype, specialmode);
-		}
-		std::cout << "Merging temporary output files into RNA-see tab output file " << outfile << ".\n";
-		for (auto& file : batchtempfiles) _checkTabFile(file);
-		_mergeFilesBatch(batchtempfiles, outfile, filetype, specialmode);
-	}
-	else {
-		std::cout << "Merging " << infiles.size() << " input files into RNA-see tab output file " << outfile << ".\n";
-		_mergeFilesBatch(infiles, outfile, filetype, specialmode);
-	}
+	if (shard.count > 1) _selectShard(infiles);
+	return _mergeTree(infiles, outputs, 0, filetype, specialmode);
 }
 
 int _removeRuns(std::vector<InputFileData>& files, const std::vector<std::string>& removalvec, bool removedups) {
@@ -410,12 +1892,52 @@ int _removeRuns(std::vector<InputFileData>& files, const std::vector<std::string
 	return runsum;
 }
 
-// Merges all .tab or .sf files in a directory, assuming that .sf files are named after runs
-void mergeFiles(const std::string& outfile, const std::vector<std::filesystem::path>& files, std::vector<std::string>& removals, bool overwrite = false, const FileType filetype = FileType::Either,
-	RunnerOutput specialmode = RunnerOutput::normal,  bool removedups = false) 
+// True if both paths name the same file (or would, once created)
+bool _samePath(const std::filesystem::path& a, const std::filesystem::path& b) {
+	std::error_code ec;
+	return std::filesystem::weakly_canonical(a, ec) == std::filesystem::weakly_canonical(b, ec);
+}
+
+// Checks the merged file being appended to; runs it already holds are dropped from the new files
+InputFileData _checkAppendBase(const std::filesystem::path& appendto, std::vector<InputFileData>& newFiles) {
+	InputFileData base;
+	base.path = appendto;
+	if (!_checkFile(base, FileType::Either, std::cerr) || (base.filetype != FileType::Tab && base.filetype != FileType::Bin)) {
+		std::cerr << "File " << appendto << " is not a merged RNA-see file that can be appended to.\n";
+		exit(1);
+	}
+	if (joinMode == JoinMode::none && base.filetype == FileType::Tab) base.geneFingerprint = _textGeneFingerprint(base);
+	std::vector<std::string> existing;
+	existing.reserve(base.columns.size());
+	for (auto& col : base.columns) existing.push_back(col.runname);
+	const size_t before = newFiles.size();
+	const int runsum = _removeRuns(newFiles, existing, false);
+	std::cout << "Appending to " << base.columns.size() << " runs in " << appendto << "; " << (before - newFiles.size())
+		<< " input files hold only runs already present, " << runsum << " new runs from " << newFiles.size() << " files remain.\n";
+	return base;
+}
+
+// Merges all .tab or .sf files in a directory, assuming that .sf files are named after runs.
+// With appendto, the runs of the files are added as new columns after those of that existing merged file, which is
+// read once as a whole (the inputs it was merged from are not opened again); the output may be appendto itself.
+void mergeFiles(const std::string& outfile, std::vector<std::filesystem::path> files, std::vector<std::string>& removals, bool overwrite = false, const FileType filetype = FileType::Either,
+	RunnerOutput specialmode = RunnerOutput::normal,  bool removedups = false, const std::filesystem::path& appendto = "") 
 {
+	// The output (and the merged file being appended to) never count as inputs, e.g. when re-gathering the output's directory
+	const std::string outKey = InputManifest::key(outfile);
+	const std::string appendKey = appendto.empty() ? std::string() : InputManifest::key(appendto);
+	files.erase(std::remove_if(files.begin(), files.end(), [&](const std::filesystem::path& file) {
+		const std::string key = InputManifest::key(file);
+		return key == outKey || key == appendKey;
+	}), files.end());
+
+	// Checks are recorded in the manifest straight away, so they are kept even if the merge fails
+	InputManifest manifest;
+	const std::string manifestPath = outfile + ".manifest";
+	if (useManifest) manifest.load(manifestPath);
 	std::vector<InputFileData> goodFiles;
-	int runsum = _checkFiles(files, goodFiles, filetype);
+	int runsum = _checkFiles(files, goodFiles, filetype, useManifest ? &manifest : nullptr);
+	if (useManifest && !manifest.save(manifestPath)) std::cerr << "Failed to write manifest " << manifestPath << "\n";
 
 	if (removedups || removals.size()) {
 		std::cout << "Pre-run removal, was going to merge " << runsum << " runs from " << goodFiles.size() << " files, including:\n";
@@ -435,23 +1957,170 @@ void mergeFiles(const std::string& outfile, const std::vector<std::filesystem::p
 		}
 	}
 
-	_mergeFiles(goodFiles, outfile, overwrite, FileType::Either, specialmode);
+	if (appendto.empty()) {
+		if (!_mergeFiles(goodFiles, outfile, overwrite, FileType::Either, specialmode)) exit(1);
+	}
+	else {
+		InputFileData base = _checkAppendBase(appendto, goodFiles);
+		if (goodFiles.empty()) {
+			std::cout << "No new runs to append, " << outfile << " left as it is.\n";
+			return;
+		}
+		goodFiles.insert(goodFiles.begin(), base);
+		if (!_samePath(appendto, outfile)) {
+			if (!_mergeFiles(goodFiles, outfile, overwrite, FileType::Either, specialmode)) exit(1);
+		}
+		else { // appending in place: merge next to the old file, then replace it
+			if (specialmode == RunnerOutput::printruns || specialmode == RunnerOutput::printgenes) {
+				std::cerr << "The run or gene list would replace " << outfile << ", the file being appended to; give another output file.\n";
+				exit(1);
+			}
+			const std::string tempfile = outfile + "_append_temp";
+			const bool merged = _mergeFiles(goodFiles, tempfile, true, FileType::Either, specialmode);
+			std::error_code ec;
+			if (merged && specialmode == RunnerOutput::normal) std::filesystem::rename(tempfile, outfile, ec);
+			else std::filesystem::remove(tempfile, ec);
+			if (!merged) exit(1);
+			if (ec) {
+				std::cerr << "Failed to replace " << outfile << " with the merged file " << tempfile << "\n";
+				exit(1);
+			}
+		}
+	}
+
+	// The line indexes built for a shard are kept, so that later runs of every shard can seek straight to their slice
+	if (useManifest && shard.count > 1) {
+		for (auto& file : goodFiles) {
+			auto it = manifest.entries.find(InputManifest::key(file.path));
+			if (it != manifest.entries.end()) it->second.lineIndex = file.lineIndex;
+		}
+		if (!manifest.save(manifestPath)) std::cerr << "Failed to write manifest " << manifestPath << "\n";
+	}
+}
+
+// Whether a file has the extension of a possible input, so that directory walks can skip everything else unopened.
+// Run directories also hold .sf and .tsv files that are not runs (quant.genes.sf, aux_info/ambig_info.tsv), so
+// below the top directory (nested) Salmon and Kallisto files are only taken under their per-run names.
+bool _candidateFile(const std::filesystem::path& path, const bool nested) {
+	const auto plain = _plainPath(path);
+	if (isGzipPath(path) && plain.extension() == ".rnabin") return false;
+	if (plain.stem() == "quant.genes" || (nested && plain.parent_path().filename() == "aux_info")) return false;
+	const auto ext = plain.extension();
+	if (tsvSpec.enabled && ext == tsvSpec.extension) return true;
+	if (ext == ".sf") return !nested || plain.stem() == "quant";
+	if (ext == ".tsv") return !nested || plain.stem() == "abundance";
+	return ext == ".rnatab" || ext == ".rnabin";
 }
 
-// Gathers and merges all .tab or .sf files in a directory, assuming that .sf files are named after runs
+// Lists the candidate input files anywhere below dir, sorted. Directories are read on up to `threads` threads that
+// share a stack of directories still to read; entry types come from the directory listing itself, so no file is
+// opened or stat'ed. Symbolic links to directories are not followed.
+std::vector<std::filesystem::path> _walkDirectory(const std::filesystem::path& dir, const unsigned int threads) {
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::vector<std::filesystem::path> pending = { dir };
+	std::vector<std::filesystem::path> found;
+	size_t busy = 0, directories = 0;
+	auto work = [&]() {
+		std::vector<std::filesystem::path> files, subdirs;
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			wake.wait(lock, [&] { return !pending.empty() || !busy; });
+			if (pending.empty()) return; // nothing left to read, and nobody reading who could add more
+			const std::filesystem::path next = std::move(pending.back());
+			pending.pop_back();
+			++busy;
+			lock.unlock();
+
+			files.clear();
+			subdirs.clear();
+			std::error_code ec;
+			for (std::filesystem::directory_iterator it(next, std::filesystem::directory_options::skip_permission_denied, ec), end; !ec && it != end; it.increment(ec)) {
+				std::error_code typeError;
+				if (it->is_directory(typeError) && !it->is_symlink(typeError)) subdirs.push_back(it->path());
+				else if (_candidateFile(it->path(), next != dir)) files.push_back(it->path());
+			}
+			if (ec) {
+				std::lock_guard<std::mutex> errorLock(mutex);
+				std::cerr << "Could not read directory " << next << ": " << ec.message() << "\n";
+			}
+
+			lock.lock();
+			--busy;
+			++directories;
+			found.insert(found.end(), files.begin(), files.end());
+			pending.insert(pending.end(), subdirs.begin(), subdirs.end());
+			wake.notify_all();
+		}
+	};
+	std::vector<std::thread> pool;
+	for (unsigned int t = 1; t < std::max(1u, threads); ++t) pool.emplace_back(work);
+	work();
+	for (auto& thread : pool) thread.join();
+	std::sort(found.begin(), found.end());
+	std::cout << "Walked " << directories << " directories.\n";
+	return found;
+}
+
+// Members of the tar archive that path runs into (the whole archive, a directory in it, or a single member), or
+// false if path is not inside an archive. Each archive is indexed once; its members then open like ordinary files.
+bool _archiveInputs(const std::filesystem::path& path, const bool recursive, std::vector<std::filesystem::path>& files) {
+	static std::map<std::filesystem::path, std::vector<std::filesystem::path>> indexed;
+	std::filesystem::path archive, inner;
+	if (!splitArchivePath(path, archive, inner)) return false;
+	auto it = indexed.find(archive);
+	if (it == indexed.end()) {
+		std::vector<std::filesystem::path> members;
+		std::string error;
+		if (!indexTarArchive(archive, members, error)) {
+			std::cerr << "Could not read archive " << archive << " (" << error << ")\n.";
+			exit(1);
+		}
+		std::cout << "Indexed " << members.size() << " files in archive " << archive << "\n";
+		it = indexed.emplace(archive, std::move(members)).first;
+	}
+	const std::filesystem::path base = (archive / inner).lexically_normal();
+	if (findArchiveMember(base)) {
+		files.push_back(base);
+		return true;
+	}
+	for (auto& member : it->second) {
+		const std::filesystem::path rel = member.lexically_normal().lexically_relative(base);
+		if (rel.empty() || *rel.begin() == "..") continue;
+		if (!recursive && rel.has_parent_path()) continue;
+		if (_candidateFile(member, rel.has_parent_path())) files.push_back(member);
+	}
+	return true;
+}
+
+// Gathers and merges all .tab or .sf files in a directory, assuming that .sf files are named after runs (or, when
+// recursing into run directories, that quant.sf and abundance.tsv files are named after their directory)
 void gatherFiles(const std::string& outfile, std::vector<std::string>& removals, const std::filesystem::path& dir = "", bool overwrite = false, const FileType filetype = FileType::Either,
-	RunnerOutput specialmode = RunnerOutput::normal, bool removedups = false) 
+	RunnerOutput specialmode = RunnerOutput::normal, bool removedups = false, const std::filesystem::path& appendto = "", const bool recursive = false) 
 {
-	std::cout << "Gathering and checking files from : " << dir << "\n";
+	std::cout << "Gathering and checking files from : " << dir << (recursive ? " and its subdirectories" : "") << "\n";
 	// Loop over directory contents, making a list of good files
 	std::vector<std::filesystem::path> checkFiles;
-	std::vector<InputFileData> goodFiles;
-	for (auto& file : std::filesystem::directory_iterator(dir)) checkFiles.push_back(file.path().string());
+	if (_archiveInputs(dir, recursive, checkFiles)) {
+		// the directory is (inside) a tar archive
+	}
+	else if (recursive) {
+		checkFiles = _walkDirectory(dir, workerThreads);
+	}
+	else {
+		for (auto& file : std::filesystem::directory_iterator(dir)) checkFiles.push_back(file.path().string());
+	}
+	// Archives found in the directory contribute all of their inputs
+	std::vector<std::filesystem::path> listed;
+	listed.swap(checkFiles);
+	for (auto& file : listed) {
+		if (file.extension() != ".tar" || !_archiveInputs(file, true, checkFiles)) checkFiles.push_back(file);
+	}
 	std::cout << "Directory holds " << checkFiles.size() << " files, including:\n";
 	for (int i = 0; (i < 3) && (i < checkFiles.size()); ++i) {
 		std::cout << "\t" << checkFiles.at(i) << "\n";
 	}
-	mergeFiles(outfile, checkFiles, removals, overwrite, filetype, specialmode, removedups);
+	mergeFiles(outfile, checkFiles, removals, overwrite, filetype, specialmode, removedups, appendto);
 }
 
 // In backend function:
@@ -464,6 +2133,58 @@ void gatherFiles(const std::string& outfile, std::vector<std::string>& removals,
 //	mergeFiles(outFile, { fileA, fileB }, FileType::Tab);
 //}
 
+// Puts the RNA-see tab outputs of a sharded merge (--shard) back together, given in shard order. The shards must
+// all start with the same header line, which is written once; the gene rows of each shard are copied from its
+// mapping as they are, without being parsed.
+void concatShards(const std::string& outfile, const std::vector<std::string>& shards, const bool overwrite) {
+	if (std::filesystem::exists(outfile) && !overwrite) {
+		std::cerr << "Output file already exists\n";
+		exit(1);
+	}
+	std::string header;
+	for (auto& path : shards) {
+		std::string line;
+		if (!readFirstLine(path, line)) {
+			std::cerr << "Shard " << path << " could not be read.\n";
+			exit(1);
+		}
+		if (&path == &shards.front()) {
+			header = line;
+			if (header.rfind("RNA-see TPM data file", 0) != 0) {
+				std::cerr << "Shard " << path << " is not an RNA-see tab file.\n";
+				exit(1);
+			}
+		}
+		else if (line != header) {
+			std::cerr << "Shard " << path << " does not have the same runs as " << shards.front() << ".\n";
+			exit(1);
+		}
+	}
+
+	BlockWriter out;
+	if (!out.open(outfile)) {
+		std::cerr << "Failed to open output file " << outfile << "\n";
+		exit(1);
+	}
+	out.write(header);
+	out.put('\n');
+	for (auto& path : shards) {
+		MappedFile shardFile;
+		if (!shardFile.open(path)) {
+			std::cerr << "Shard " << path << " could not be read.\n";
+			exit(1);
+		}
+		const std::string_view rows = shardFile.view().substr(skipLines(shardFile.view(), 0, 1));
+		out.write(rows);
+		if (!rows.empty() && rows.back() != '\n') out.put('\n');
+	}
+	if (!out.close()) {
+		std::cerr << "Failed to write output file " << outfile << "\n";
+		exit(1);
+	}
+	std::cout << "Concatenated " << shards.size() << " shards into " << outfile << ".\n";
+}
+
 void print_help(const argparse::ArgumentParser& parser) {
 	std::cout << "\nRNA-see runnergunner\n";
 	std::cout << "Copyright(c) 2022- Eric Fedosejevs <eric.fedosejevs@gmail.com>\n\n";
@@ -473,7 +2194,7 @@ void print_help(const argparse::ArgumentParser& parser) {
 }
 
 int main(int argc, char* argv[]) {
-	bool fakeargs = true;
+	bool fakeargs = false;
 	std::vector<char*> nargv;
 	//std::vector<std::string> args = { "-o", "arabidopsis1.rnatab", "--duplicates", "-d", "D:/Programming/RNA-see_data/data/arabidopsis20220420.tar/arabidopsis20220420/20220420/" };
 	std::vector<std::string> args = { "-o", "arabidopsis1.rnatab", "--overwrite", "-d", "D:/Programming/RNA-see_data/data/arabidopsis20220420.tar/arabidopsis20220420/20220420/" };
@@ -493,6 +2214,43 @@ int main(int argc, char* argv[]) {
 	}
 	std::cout << "\n";
 
+	if (argc > 1 && std::string_view(argv[1]) == "concat") {
+		argparse::ArgumentParser concat("runnergunner concat", "0.1", argparse::default_arguments::help);
+		concat.add_argument("-o", "--output")
+			.required()
+			.help("specify the output file");
+		concat.add_argument("-w", "--overwrite")
+			.default_value(false)
+			.implicit_value(true)
+			.nargs(0)
+			.help("overwrite existing output file");
+		concat.add_argument("shards")
+			.remaining()
+			.help("outputs of runnergunner --shard i/N, in shard order (after all options)");
+		try {
+			concat.parse_args(argc - 1, argv + 1);
+		}
+		catch (const std::runtime_error& err) {
+			std::cerr << err.what() << std::endl;
+			std::cerr << concat;
+			std::exit(1);
+		}
+		const auto shards = concat.get<std::vector<std::string>>("shards");
+		if (shards.empty()) {
+			std::cerr << "No shards to concatenate\n";
+			exit(1);
+		}
+		for (auto& path : shards) { // everything after the first shard is taken as a shard, options included
+			if (path.size() > 1 && path.front() == '-') {
+				std::cerr << "Option " << path << " given after the shards; options go before them.\n";
+				std::cerr << concat;
+				exit(1);
+			}
+		}
+		concatShards(concat.get<std::string>("--output"), shards, concat.get<bool>("--overwrite"));
+		return 0;
+	}
+
 	argparse::ArgumentParser program("runnergunner", "0.1", argparse::default_arguments::version);
 
 	program.add_argument("-h", "--help")
@@ -509,11 +2267,17 @@ int main(int argc, char* argv[]) {
 		.help("specify the output file");
 
 	program.add_argument("-i", "--input")
-		.help("specify individual input files, one per -i flag (otherwise gathers all files in directory)");
+		.append()
+		.help("specify individual input files, one per -i flag (otherwise gathers all files in directory); a .tar archive gives all of its inputs");
 
 	program.add_argument("-x", "--remove")
+		.append()
 		.help("remove the specified runs from input files");
 
+	program.add_argument("-a", "--append")
+		.nargs(1)
+		.help("append the runs of the input files to this existing merged file (.rnatab or .rnabin), skipping runs it already holds; the output may be the same file");
+
 	program.add_argument("-p", "--duplicates")
 		.default_value(false)
 		.implicit_value(true)
@@ -542,13 +2306,107 @@ int main(int argc, char* argv[]) {
 		.default_value(std::filesystem::current_path().string())
 		.required()
 		.nargs(1)
-		.help("directory of files being combined");
+		.help("directory of files being combined; may be a .tar archive or a directory inside one");
+
+	program.add_argument("-R", "--recursive")
+		.default_value(false)
+		.implicit_value(true)
+		.nargs(0)
+		.help("gather files from all subdirectories of the directory too (e.g. run_dir/quant.sf), naming runs of quant.sf and abundance.tsv files after their directory");
 
 	program.add_argument("-t", "--type")
 		.default_value(std::string("any"))
 		.required()
 		.nargs(1)
-		.help("restrict accepted input file types (salmon (*.sf), rna-see (*.rnatab), any)");
+		.help("restrict accepted input file types (salmon (*.sf), rna-see (*.rnatab), rnabin (*.rnabin), kallisto (*.tsv), tsv (see --tsv), any)");
+
+	program.add_argument("-m", "--mmap")
+		.default_value(false)
+		.implicit_value(true)
+		.nargs(0)
+		.help("read input files through memory maps instead of buffered streams");
+
+	program.add_argument("-j", "--threads")
+		.default_value(defaultWorkerThreads())
+		.scan<'u', unsigned int>()
+		.nargs(1)
+		.help("number of worker threads (defaults to the number of hardware threads)");
+
+	program.add_argument("-c", "--colgroups")
+		.default_value(1u)
+		.scan<'u', unsigned int>()
+		.nargs(1)
+		.help("merge the inputs in this many column groups in parallel, then stitch them together (more groups are used if there are more files than can be open at once)");
+
+	program.add_argument("-f", "--maxfiles")
+		.default_value(0u)
+		.scan<'u', unsigned int>()
+		.nargs(1)
+		.help("maximum number of input files one merge holds open (default: as many as the raised open file limit allows, up to 4096)");
+
+	program.add_argument("--format")
+		.default_value(std::string("auto"))
+		.nargs(1)
+		.help("output format: rnatab (text), rnabin (binary matrix), mtx (sparse MatrixMarket text, names in <output>.genes and <output>.runs) or csc (sparse binary .rnacsc, by run); by default picked from the output file extension");
+
+	program.add_argument("--dtype")
+		.default_value(std::string("float32"))
+		.nargs(1)
+		.help("value type of rnabin and csc output (float32, float64)");
+
+	program.add_argument("--layout")
+		.default_value(std::string("row"))
+		.nargs(1)
+		.help("value order within rnabin blocks (row: runs vary fastest, column: genes vary fastest)");
+
+	program.add_argument("--precision")
+		.scan<'i', int>()
+		.nargs(1)
+		.help("rewrite the values of text output with this many significant digits (1-17), checking that every value is a number");
+
+	program.add_argument("--fixed")
+		.scan<'i', int>()
+		.nargs(1)
+		.help("rewrite the values of text output with this many decimals (0-17), checking that every value is a number");
+
+	program.add_argument("--shard")
+		.nargs(1)
+		.help("merge only slice i of N equal slices of the gene rows, given as i/N (0 <= i < N); put the rnatab outputs of all N slices together with: runnergunner concat -o <output> <shard outputs...>");
+
+	program.add_argument("--writers")
+		.default_value(1u)
+		.scan<'u', unsigned int>()
+		.nargs(1)
+		.help("format and write rnatab output with this many threads, each writing whole blocks of rows in place (default: 1, one writer)");
+
+	program.add_argument("--tsv")
+		.nargs(1)
+		.help("also merge generic tab-separated files, described as id=<field>,value=<field>[,header=yes|no][,ext=<extension>] with fields given by header name or 1-based number (defaults: id=1, value=2, header=yes, ext=.tsv)");
+
+	program.add_argument("-q", "--quantity")
+		.default_value(std::string("TPM"))
+		.nargs(1)
+		.help("Salmon column(s) to merge, comma separated (Length, EffectiveLength, TPM, NumReads); with several, one output is written per column, named <output>.<column>.<ext>");
+
+	program.add_argument("--join")
+		.default_value(std::string("none"))
+		.nargs(1)
+		.help("join inputs on gene name instead of requiring the same genes in the same order: inner (genes in every input) or outer (genes in any input)");
+
+	program.add_argument("--fill")
+		.default_value(std::string("0"))
+		.nargs(1)
+		.help("value of runs that lack a gene in an outer join");
+
+	program.add_argument("--tx2gene")
+		.nargs(1)
+		.help("add up transcript rows into gene rows while merging, using this transcript to gene table (tab or comma separated); only for the TPM and NumReads quantities");
+
+	program.add_argument("--nomanifest")
+		.default_value(false)
+		.implicit_value(true)
+		.nargs(0)
+		.help("do not read or write the manifest of checked input files kept next to the output (<output>.manifest)");
 
 	program.add_argument("-w", "--overwrite")
 		.default_value(false)
@@ -571,8 +2429,8 @@ int main(int argc, char* argv[]) {
 		if (dir.back() != '/' || dir.back() != '\\') dir.push_back('/'); // add terminating slash to dir
 		auto output = program.get<std::string>("--output");
 
-		std::filesystem::path tmpdir(dir);
-		if (!exists(tmpdir)) {
+		std::filesystem::path tmpdir(dir), archive, inner;
+		if (!exists(tmpdir) && !splitArchivePath(tmpdir, archive, inner)) {
 			std::cerr << "Directory does not exist: " << tmpdir << "\n.";
 			exit(1);
 		}
@@ -585,6 +2443,15 @@ int main(int argc, char* argv[]) {
 		else if (typestr == "rna-see") {
 			type = FileType::Tab;
 		}
+		else if (typestr == "rnabin") {
+			type = FileType::Bin;
+		}
+		else if (typestr == "kallisto") {
+			type = FileType::Kallisto;
+		}
+		else if (typestr == "tsv") {
+			type = FileType::Tsv;
+		}
 		else if (typestr == "default" || typestr == "any") {
 			type = FileType::Either;
 		}
@@ -593,6 +2460,85 @@ int main(int argc, char* argv[]) {
 			exit(1);
 		}
 
+		auto formatstr = program.get<std::string>("--format");
+		if (formatstr == "auto") {
+			const auto ext = std::filesystem::path(output).extension();
+			formatstr = (ext == ".rnabin") ? "rnabin" : (ext == ".mtx") ? "mtx" : (ext == ".rnacsc") ? "csc" : "rnatab";
+		}
+		if (formatstr == "rnabin") {
+			finalOutput.format = OutputFormat::rnabin;
+		}
+		else if (formatstr == "mtx") {
+			finalOutput.format = OutputFormat::mtx;
+		}
+		else if (formatstr == "csc") {
+			finalOutput.format = OutputFormat::csc;
+		}
+		else if (formatstr != "rnatab") {
+			std::cerr << "Invalid output format specified: " << formatstr << "\n.";
+			exit(1);
+		}
+
+		auto dtypestr = program.get<std::string>("--dtype");
+		if (dtypestr == "float64") {
+			finalOutput.dtype = RnabinType::float64;
+		}
+		else if (dtypestr != "float32") {
+			std::cerr << "Invalid rnabin value type specified: " << dtypestr << "\n.";
+			exit(1);
+		}
+
+		auto layoutstr = program.get<std::string>("--layout");
+		if (layoutstr == "column") {
+			finalOutput.layout = RnabinLayout::colmajor;
+		}
+		else if (layoutstr != "row") {
+			std::cerr << "Invalid rnabin layout specified: " << layoutstr << "\n.";
+			exit(1);
+		}
+
+		if (program.is_used("--precision") || program.is_used("--fixed")) {
+			if (program.is_used("--precision") && program.is_used("--fixed")) {
+				std::cerr << "Specify either --precision or --fixed, not both\n.";
+				exit(1);
+			}
+			if (finalOutput.format == OutputFormat::rnabin || finalOutput.format == OutputFormat::csc) {
+				std::cerr << "--precision and --fixed only apply to text output\n.";
+				exit(1);
+			}
+			const bool fixed = program.is_used("--fixed");
+			const int digits = program.get<int>(fixed ? "--fixed" : "--precision");
+			if (digits < (fixed ? 0 : 1) || digits > 17) {
+				std::cerr << "Invalid number of " << (fixed ? "decimals" : "significant digits") << " specified: " << digits << "\n.";
+				exit(1);
+			}
+			finalOutput.numbers.style = fixed ? NumberFormat::Style::fixed : NumberFormat::Style::significant;
+			finalOutput.numbers.digits = digits;
+		}
+
+		if (program.is_used("--shard")) {
+			const std::string shardstr = program.get<std::string>("--shard");
+			const size_t slash = shardstr.find('/');
+			char* end = nullptr;
+			shard.index = std::strtoull(shardstr.c_str(), &end, 10);
+			const bool good = slash != std::string::npos && end == shardstr.c_str() + slash;
+			shard.count = good ? std::strtoull(shardstr.c_str() + slash + 1, &end, 10) : 0;
+			if (!good || *end || shard.count < 1 || shard.index >= shard.count) {
+				std::cerr << "Invalid shard specified (expected i/N with 0 <= i < N): " << shardstr << "\n.";
+				exit(1);
+			}
+			if (finalOutput.format != OutputFormat::rnatab) {
+				std::cerr << "--shard only applies to rnatab output\n.";
+				exit(1);
+			}
+		}
+
+		finalOutput.writers = std::max(1u, program.get<unsigned int>("--writers"));
+		if (finalOutput.writers > 1 && finalOutput.format != OutputFormat::rnatab) {
+			std::cerr << "--writers only applies to rnatab output\n.";
+			exit(1);
+		}
+
 		RunnerOutput specialmode = RunnerOutput::normal;
 		bool removedups = false;
 		bool overwrite = false;
@@ -620,6 +2566,118 @@ int main(int argc, char* argv[]) {
 			overwrite = true;
 		}
 
+		workerThreads = std::max(1u, program.get<unsigned int>("--threads"));
+		columnGroups = std::max(1u, program.get<unsigned int>("--colgroups"));
+		fileSystemMaxFilesOpen = _configureOpenFileLimit(program.get<unsigned int>("--maxfiles"));
+
+		if (program.is_used("--mmap")) {
+			inputReaderMode = InputReaderMode::mmap;
+		}
+
+		if (program.is_used("--tsv")) {
+			tsvSpec.enabled = true;
+			const std::string specstr = program.get<std::string>("--tsv");
+			for (std::string_view rest(specstr); !rest.empty();) {
+				const size_t comma = std::min(rest.find(','), rest.size());
+				const std::string_view item = rest.substr(0, comma);
+				rest.remove_prefix(std::min(comma + 1, rest.size()));
+				const size_t equals = item.find('=');
+				const std::string_view key = item.substr(0, equals);
+				const std::string value(equals == std::string_view::npos ? std::string_view() : item.substr(equals + 1));
+				if (key == "id" && !value.empty()) tsvSpec.id = value;
+				else if (key == "value" && !value.empty()) tsvSpec.value = value;
+				else if (key == "header" && (value == "yes" || value == "no")) tsvSpec.header = value == "yes";
+				else if (key == "ext" && !value.empty()) tsvSpec.extension = (value.front() == '.') ? value : "." + value;
+				else {
+					std::cerr << "Invalid tab-separated file spec item: " << item << "\n.";
+					exit(1);
+				}
+			}
+		}
+		else if (type == FileType::Tsv) {
+			std::cerr << "Tab-separated input needs a --tsv spec\n.";
+			exit(1);
+		}
+
+		auto quantitystr = program.get<std::string>("--quantity");
+		quantities.clear();
+		for (std::string_view rest(quantitystr); !rest.empty();) {
+			const size_t comma = std::min(rest.find(','), rest.size());
+			const std::string_view name = rest.substr(0, comma);
+			rest.remove_prefix(std::min(comma + 1, rest.size()));
+			const auto found = std::find(salmonColumns.begin() + 1, salmonColumns.end(), name);
+			if (found == salmonColumns.end()) {
+				std::cerr << "Invalid quantity specified: " << name << "\n.";
+				exit(1);
+			}
+			const size_t column = found - salmonColumns.begin();
+			if (std::find(quantities.begin(), quantities.end(), column) == quantities.end()) quantities.push_back(column);
+		}
+		if (quantities.empty()) {
+			std::cerr << "No quantity specified\n.";
+			exit(1);
+		}
+		if (specialmode != RunnerOutput::normal) quantities.resize(1); // run and gene lists do not depend on the quantity
+
+		auto joinstr = program.get<std::string>("--join");
+		if (joinstr == "inner") {
+			joinMode = JoinMode::inner;
+		}
+		else if (joinstr == "outer") {
+			joinMode = JoinMode::outer;
+		}
+		else if (joinstr != "none") {
+			std::cerr << "Invalid join mode specified: " << joinstr << "\n.";
+			exit(1);
+		}
+		if (joinMode != JoinMode::none && shard.count > 1) {
+			std::cerr << "Cannot shard a join: its rows are matched by gene name, not by position\n.";
+			exit(1);
+		}
+		joinFill = program.get<std::string>("--fill");
+		double fillValue;
+		if ((finalOutput.format != OutputFormat::rnatab || !finalOutput.numbers.verbatim()) && !_parseCell(joinFill, fillValue)) {
+			std::cerr << "Fill value of binary, sparse or rewritten output must be a number: " << joinFill << "\n.";
+			exit(1);
+		}
+
+		if (program.is_used("--tx2gene")) {
+			auto table = std::make_shared<Tx2Gene>();
+			std::string error;
+			if (!table->load(program.get<std::string>("--tx2gene"), error)) {
+				std::cerr << "Could not load tx2gene table " << program.get<std::string>("--tx2gene") << " (" << error << ")\n.";
+				exit(1);
+			}
+			if (program.is_used("--append")) {
+				std::cerr << "Cannot aggregate to genes while appending to an already merged file\n.";
+				exit(1);
+			}
+			if (shard.count > 1) {
+				std::cerr << "Cannot aggregate to genes in a sharded merge: the transcripts of a gene may fall in different shards\n.";
+				exit(1);
+			}
+			for (auto quantity : quantities) { // a gene's TPM and reads are the sums of its transcripts', but not its length
+				if (salmonColumns[quantity] != "TPM" && salmonColumns[quantity] != "NumReads") {
+					std::cerr << "Cannot aggregate " << salmonColumns[quantity] << " to genes: only TPM and NumReads add up\n.";
+					exit(1);
+				}
+			}
+			finalOutput.tx2gene = table;
+		}
+
+		if (program.is_used("--nomanifest")) {
+			useManifest = false;
+		}
+
+		std::filesystem::path appendto;
+		if (program.is_used("--append")) {
+			appendto = program.get<std::string>("--append");
+			if (!std::filesystem::exists(appendto)) {
+				std::cerr << "File to append to does not exist: " << appendto << "\n";
+				exit(1);
+			}
+		}
+
 		if (program.is_used("--remove")) {
 			removals = program.get<std::vector<std::string>>("--remove");
 			if (!removals.size()) { // if provided removal files
@@ -634,18 +2692,17 @@ int main(int argc, char* argv[]) {
 				std::vector<std::filesystem::path> fullpaths;
 				fullpaths.reserve(inputs.size());
 				for (std::string& filename : inputs) {
+					std::filesystem::path fullpath(filename);
 					if (program.is_used("--dir")) { // if provided input files and dir, append file names to dir, else copy
-						fullpaths.push_back(std::filesystem::path(dir + filename)); // dir should already have terminating slash
-					}
-					else {
-						fullpaths.push_back(std::filesystem::path(filename)); // dir should already have terminating slash
+						fullpath = std::filesystem::path(dir + filename); // dir should already have terminating slash
 					}
+					if (!_archiveInputs(fullpath, true, fullpaths)) fullpaths.push_back(fullpath); // archives give all of their inputs
 				}
-				mergeFiles(output, fullpaths, removals, overwrite, type, specialmode, removedups);
+				mergeFiles(output, fullpaths, removals, overwrite, type, specialmode, removedups, appendto);
 			}
 		}
 		else {
-			gatherFiles(output, removals, dir, overwrite, type, specialmode, removedups);
+			gatherFiles(output, removals, dir, overwrite, type, specialmode, removedups, appendto, program.is_used("--recursive"));
 		}
 		return 0;
 	}
@@ -0,0 +1,225 @@
+// sparse.h : Sparse matrix outputs for cohorts where most values are zero.
+//
+// MatrixMarketWriter writes the coordinate format ("%%MatrixMarket matrix coordinate real general"), one line per
+// nonzero value (gene row, run column, value, 1-based), with the gene and run names in <output>.genes and
+// <output>.runs, one per line. Rows stream straight to the file; the size line is written as a fixed-width
+// placeholder and patched once the row and nonzero counts are known, so the matrix is never read back.
+//
+// CscWriter writes an RNA-see compressed sparse column file (.rnacsc). As in .rnabin, numbers are little-endian and
+// every section starts on a 64-byte boundary:
+//   header   CscHeader (128 bytes)
+//   runs     run dictionary: for each run, a uint32 length followed by the name
+//   genes    gene dictionary: for each gene, a uint32 length followed by the name
+//   colptr   cols + 1 uint64: the nonzeros of run c are entries [colptr[c], colptr[c + 1])
+//   rowidx   nnz uint32: gene row of each entry, increasing within a run
+//   values   nnz float32 or float64
+// Rows arrive gene by gene, so the entries of each run are collected in memory (the nonzeros only) and the file is
+// written in one go at the end.
+
+#pragma once
+#include <algorithm>
+#include "blockwriter.h"
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include "rnabin.h"
+#include <string>
+#include <string_view>
+#include <vector>
+
+constexpr char cscMagic[8] = { 'R', 'N', 'A', 'S', 'E', 'E', 'C', '1' };
+constexpr uint32_t cscVersion = 1;
+
+struct CscHeader {
+	char magic[8];
+	uint32_t version;
+	uint8_t dtype;
+	uint8_t reserved0[3];
+	uint64_t rows;
+	uint64_t cols;
+	uint64_t nnz;
+	uint64_t runsOffset;
+	uint64_t genesOffset;
+	uint64_t colptrOffset;
+	uint64_t rowidxOffset;
+	uint64_t valuesOffset;
+	uint64_t reserved[6];
+};
+static_assert(sizeof(CscHeader) == 128, "CscHeader must be 128 bytes");
+
+// Writes the names of a sparse output's rows or columns, one per line
+inline bool writeNameList(const std::filesystem::path& path, const std::vector<std::string>& names) {
+	std::ofstream out(path, std::ios::trunc);
+	for (auto& name : names) out << name << '\n';
+	out.close();
+	return !out.fail();
+}
+
+class MatrixMarketWriter {
+public:
+	// formatValue appends a nonzero value as text
+	bool open(const std::filesystem::path& path, const std::vector<std::string>& runs, std::function<void(std::string&, double)> formatValue) {
+		outPath = path;
+		cols = runs.size();
+		format = std::move(formatValue);
+		if (!out.open(path)) return false;
+		out.write("%%MatrixMarket matrix coordinate real general\n");
+		out.write("% genes: " + path.filename().string() + ".genes, runs: " + path.filename().string() + ".runs\n");
+		sizeLine = out.position();
+		out.write(std::string(sizeLineWidth - 1, ' ') + "\n");
+		return writeNameList(path.string() + ".runs", runs);
+	}
+
+	// Adds the next gene row; values holds one value per run, of which only the nonzeros are written
+	void addRow(std::string_view gene, const double* values) {
+		genes.emplace_back(gene);
+		char prefix[24];
+		const size_t prefixLen = std::to_chars(prefix, prefix + sizeof(prefix), genes.size()).ptr - prefix;
+		for (uint64_t c = 0; c < cols; ++c) {
+			if (values[c] == 0) continue;
+			text.append(prefix, prefixLen);
+			text.push_back(' ');
+			char col[24];
+			text.append(col, std::to_chars(col, col + sizeof(col), c + 1).ptr);
+			text.push_back(' ');
+			format(text, values[c]);
+			text.push_back('\n');
+			++nnz;
+		}
+		out.write(text);
+		text.clear();
+	}
+
+	bool finish() {
+		const std::string size = std::to_string(genes.size()) + " " + std::to_string(cols) + " " + std::to_string(nnz);
+		out.writeAt(sizeLine, size.data(), size.size()); // the rest of the placeholder stays as trailing blanks
+		return out.close() && writeNameList(outPath.string() + ".genes", genes);
+	}
+
+	uint64_t nonzeros() const { return nnz; }
+
+private:
+	static constexpr size_t sizeLineWidth = 64; // room for three 20-digit counts
+
+	std::filesystem::path outPath;
+	BlockWriter out;
+	std::function<void(std::string&, double)> format;
+	uint64_t sizeLine = 0;
+	uint64_t cols = 0;
+	uint64_t nnz = 0;
+	std::string text;
+	std::vector<std::string> genes;
+};
+
+class CscWriter {
+public:
+	bool open(const std::filesystem::path& path, const std::vector<std::string>& runNames, const RnabinType type) {
+		dtype = type;
+		runs = runNames;
+		rowsOfRun.assign(runs.size(), {});
+		valuesOfRun.assign(runs.size(), {});
+		return out.open(path);
+	}
+
+	// Adds the next gene row; values holds one value per run
+	void addRow(std::string_view gene, const double* values) {
+		const uint32_t row = (uint32_t)genes.size();
+		genes.emplace_back(gene);
+		for (size_t c = 0; c < runs.size(); ++c) {
+			if (values[c] == 0) continue;
+			rowsOfRun[c].push_back(row);
+			valuesOfRun[c].push_back(values[c]);
+			++nnz;
+		}
+	}
+
+	bool finish() {
+		CscHeader header;
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, cscMagic, sizeof(cscMagic));
+		header.version = cscVersion;
+		header.dtype = (uint8_t)dtype;
+		header.rows = genes.size();
+		header.cols = runs.size();
+		header.nnz = nnz;
+		_write((const char*)&header, sizeof(header));
+
+		header.runsOffset = position;
+		_writeNames(runs);
+		header.genesOffset = position;
+		_writeNames(genes);
+
+		header.colptrOffset = position;
+		uint64_t entries = 0;
+		_write((const char*)&entries, sizeof(entries));
+		for (auto& rows : rowsOfRun) {
+			entries += rows.size();
+			_write((const char*)&entries, sizeof(entries));
+		}
+		_pad();
+
+		header.rowidxOffset = position;
+		for (auto& rows : rowsOfRun) {
+			if (!rows.empty()) _write((const char*)rows.data(), rows.size() * sizeof(uint32_t));
+			std::vector<uint32_t>().swap(rows);
+		}
+		_pad();
+
+		header.valuesOffset = position;
+		std::string packed;
+		for (auto& values : valuesOfRun) {
+			packed.clear();
+			for (const double value : values) {
+				if (dtype == RnabinType::float64) {
+					packed.append((const char*)&value, sizeof(value));
+				}
+				else {
+					const float single = (float)value;
+					packed.append((const char*)&single, sizeof(single));
+				}
+			}
+			_write(packed.data(), packed.size());
+			std::vector<double>().swap(values);
+		}
+
+		out.writeAt(0, (const char*)&header, sizeof(header));
+		return out.close();
+	}
+
+	uint64_t nonzeros() const { return nnz; }
+
+private:
+	void _write(const char* data, size_t len) {
+		out.write(data, len);
+		position += len;
+	}
+
+	void _pad() {
+		static const char zeros[rnabinAlignment] = {};
+		_write(zeros, (rnabinAlignment - position % rnabinAlignment) % rnabinAlignment);
+	}
+
+	void _writeNames(const std::vector<std::string>& names) {
+		std::string dict;
+		for (auto& name : names) {
+			const uint32_t len = (uint32_t)name.size();
+			dict.append((const char*)&len, sizeof(len));
+			dict.append(name);
+		}
+		_write(dict.data(), dict.size());
+		_pad();
+	}
+
+	BlockWriter out;
+	RnabinType dtype = RnabinType::float32;
+	uint64_t position = 0;
+	uint64_t nnz = 0;
+	std::vector<std::string> runs;
+	std::vector<std::string> genes;
+	std::vector<std::vector<uint32_t>> rowsOfRun;
+	std::vector<std::vector<double>> valuesOfRun;
+};
@@ -0,0 +1,143 @@
+// tarfile.h : Merge inputs read straight out of tar archives.
+//
+// An archive is mapped once and its member headers are indexed in one sequential pass (512-byte ustar headers,
+// with GNU long names and pax path/size records); member contents are never touched while indexing. Every
+// regular member is registered as <archive>/<member> (see ArchiveMember in linereader.h), so the rest of the
+// program opens it like any other file while the bytes are served from the archive's mapping in place.
+
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include "linereader.h"
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+constexpr uint64_t tarBlockSize = 512;
+
+// Value of a numeric header field: octal text, or GNU base-256 (high bit of the first byte set) for large values
+inline bool _tarNumber(const char* field, const size_t len, uint64_t& value) {
+	value = 0;
+	if ((unsigned char)field[0] & 0x80) {
+		for (size_t i = 1; i < len; ++i) value = (value << 8) | (unsigned char)field[i];
+		return true;
+	}
+	size_t i = 0;
+	while (i < len && field[i] == ' ') ++i;
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i) value = (value << 3) | (uint64_t)(field[i] - '0');
+	return i == len || field[i] == '\0' || field[i] == ' ';
+}
+
+// Text of a NUL-padded header field
+inline std::string_view _tarString(const char* field, const size_t len) {
+	return std::string_view(field, strnlen(field, len));
+}
+
+// The checksum is the byte sum of the header with its own field counted as spaces
+inline bool _tarChecksumOk(const char* header) {
+	uint64_t stored;
+	if (!_tarNumber(header + 148, 8, stored)) return false;
+	uint64_t sum = 0;
+	for (size_t i = 0; i < tarBlockSize; ++i) sum += (i >= 148 && i < 156) ? ' ' : (unsigned char)header[i];
+	return sum == stored;
+}
+
+// Applies the path and size records of a pax extended header ("<length> <key>=<value>\n" each)
+inline void _tarPaxRecords(std::string_view records, std::string& path, uint64_t& size, bool& hasSize) {
+	while (!records.empty()) {
+		const size_t space = records.find(' ');
+		if (space == std::string_view::npos) return;
+		const size_t len = std::strtoull(std::string(records.substr(0, space)).c_str(), nullptr, 10);
+		if (len <= space || len > records.size()) return;
+		const std::string_view record = records.substr(space + 1, len - space - 2); // without the trailing '\n'
+		const size_t eq = record.find('=');
+		if (eq != std::string_view::npos) {
+			const std::string_view key = record.substr(0, eq), value = record.substr(eq + 1);
+			if (key == "path") path = value;
+			else if (key == "size") {
+				size = std::strtoull(std::string(value).c_str(), nullptr, 10);
+				hasSize = true;
+			}
+		}
+		records.remove_prefix(len);
+	}
+}
+
+// Maps the archive, registers its regular members and lists their paths (<archive>/<member>) in archive order.
+// On failure returns false and leaves the reason in error.
+inline bool indexTarArchive(const std::filesystem::path& archivePath, std::vector<std::filesystem::path>& members, std::string& error) {
+	auto archive = std::make_shared<MappedFile>();
+	if (!archive->open(archivePath, false)) {
+		error = "failed to open";
+		return false;
+	}
+	const std::string_view data = archive->view();
+	std::string longName, paxPath;
+	uint64_t paxSize = 0;
+	bool hasPaxSize = false;
+	for (uint64_t offset = 0; offset + tarBlockSize <= data.size();) {
+		const char* header = data.data() + offset;
+		if (header[0] == '\0') break; // end-of-archive blocks
+		if (!_tarChecksumOk(header)) {
+			error = "bad header checksum at offset " + std::to_string(offset) + " (not a tar archive?)";
+			return false;
+		}
+		uint64_t size, mtime;
+		_tarNumber(header + 124, 12, size);
+		_tarNumber(header + 136, 12, mtime);
+		if (hasPaxSize) size = paxSize;
+		const char type = header[156];
+		const uint64_t dataOffset = offset + tarBlockSize;
+		if (dataOffset + size > data.size()) {
+			error = "member at offset " + std::to_string(offset) + " extends past the end of the archive";
+			return false;
+		}
+		const std::string_view contents = data.substr(dataOffset, size);
+		offset = dataOffset + (size + tarBlockSize - 1) / tarBlockSize * tarBlockSize;
+
+		if (type == 'L') { // GNU long name of the next member
+			longName = _tarString(contents.data(), contents.size());
+			continue;
+		}
+		if (type == 'x') { // pax extended header of the next member
+			_tarPaxRecords(contents, paxPath, paxSize, hasPaxSize);
+			continue;
+		}
+		std::string name;
+		if (!paxPath.empty()) name = paxPath;
+		else if (!longName.empty()) name = longName;
+		else {
+			const std::string_view prefix = (std::memcmp(header + 257, "ustar", 5) == 0) ? _tarString(header + 345, 155) : std::string_view();
+			name = prefix.empty() ? std::string(_tarString(header, 100)) : std::string(prefix) + "/" + std::string(_tarString(header, 100));
+		}
+		longName.clear();
+		paxPath.clear();
+		hasPaxSize = false;
+		if (type != '0' && type != '\0' && type != '7') continue; // directories, links and global pax headers
+		const std::filesystem::path member = archivePath / std::filesystem::path(name).relative_path();
+		archiveMembers()[archiveMemberKey(member)] = { archive, dataOffset, size, (int64_t)mtime };
+		members.push_back(member);
+	}
+	return true;
+}
+
+// Splits a path that runs into a tar archive (data.tar/run1/quant.sf) into the archive and the path inside it;
+// false if no component of the path is an existing .tar file
+inline bool splitArchivePath(const std::filesystem::path& path, std::filesystem::path& archive, std::filesystem::path& inner) {
+	std::filesystem::path prefix;
+	for (auto it = path.begin(); it != path.end(); ++it) {
+		prefix /= *it;
+		std::error_code ec;
+		if (it->extension() == ".tar" && std::filesystem::is_regular_file(prefix, ec)) {
+			archive = prefix;
+			inner.clear();
+			for (++it; it != path.end(); ++it) {
+				if (!it->empty()) inner /= *it;
+			}
+			return true;
+		}
+	}
+	return false;
+}
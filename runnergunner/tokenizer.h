@@ -0,0 +1,116 @@
+// tokenizer.h : Tab/newline tokenizing for quantification files.
+//
+// The scanner finds every occurrence of one or two delimiter bytes in a buffer. On x86 it compares
+// 16 bytes at a time with SSE2 and walks the resulting bit masks, with a plain byte loop as the fallback
+// on other architectures. Lines are too short for wider vectors to pay off: they would leave most of a
+// line to the byte loop.
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RUNNERGUNNER_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+enum class SimdLevel { scalar, sse2 };
+
+// Instruction set used by the scanner; can be lowered (e.g. by benchmarks) but never raised above what the CPU supports
+inline SimdLevel& simdLevel() {
+#if defined(RUNNERGUNNER_X86)
+	static SimdLevel level = SimdLevel::sse2;
+#else
+	static SimdLevel level = SimdLevel::scalar;
+#endif
+	return level;
+}
+
+inline unsigned int _countTrailingZeros(uint32_t mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (unsigned int)index;
+#else
+	return (unsigned int)__builtin_ctz(mask);
+#endif
+}
+
+// Byte loop behind scanDelimiters, for other architectures and for the tail of the vector loop
+template <typename Emit>
+inline void _scanDelimitersScalar(const char* data, size_t len, const char a, const char b, Emit&& emit) {
+	for (size_t i = 0; i < len; ++i) {
+		if (data[i] == a || data[i] == b) emit(i);
+	}
+}
+
+#if defined(RUNNERGUNNER_X86)
+template <typename Emit>
+inline void _scanDelimitersSSE2(const char* data, size_t len, const char a, const char b, Emit&& emit) {
+	const __m128i va = _mm_set1_epi8(a);
+	const __m128i vb = _mm_set1_epi8(b);
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)));
+		while (mask) {
+			emit(i + _countTrailingZeros(mask));
+			mask &= mask - 1;
+		}
+	}
+	_scanDelimitersScalar(data + i, len - i, a, b, [&](size_t offset) { emit(i + offset); });
+}
+#endif
+
+// Calls emit(offset) for every byte of [data, data + len) equal to a or b, in order
+template <typename Emit>
+inline void scanDelimiters(const char* data, size_t len, const char a, const char b, Emit&& emit) {
+#if defined(RUNNERGUNNER_X86)
+	if (simdLevel() != SimdLevel::scalar) {
+		_scanDelimitersSSE2(data, len, a, b, emit);
+		return;
+	}
+#endif
+	_scanDelimitersScalar(data, len, a, b, emit);
+}
+
+// Byte-at-a-time splitter, kept as the reference implementation for benchmarks
+inline void splitLineOnCharScalar(std::string_view instring, const char delimiter, std::vector<std::string_view>& tokens, const size_t& sizehint)
+{
+	tokens.clear();
+	tokens.reserve(sizehint);
+	const char* _Beg(instring.data()), * _End(instring.data() + instring.size());
+	for (const char* _Ptr = _Beg; _Ptr < _End; ++_Ptr)
+	{
+		if (*_Ptr == delimiter)
+		{
+			tokens.emplace_back(_Beg, _Ptr - _Beg);
+			_Beg = 1 + _Ptr;
+		}
+	}
+	tokens.emplace_back(_Beg, _End - _Beg);
+}
+
+// C code; should be fast
+// Tokens are views into instring, so they are only valid for as long as the line buffer is left untouched
+inline void splitLineOnChar(std::string_view instring, const char delimiter, std::vector<std::string_view>& tokens, const size_t& sizehint)
+{
+	tokens.clear();
+	tokens.reserve(sizehint);
+	const char* _Beg = instring.data();
+	size_t start = 0;
+	scanDelimiters(_Beg, instring.size(), delimiter, delimiter, [&](size_t offset) {
+		tokens.emplace_back(_Beg + start, offset - start);
+		start = offset + 1;
+	});
+	tokens.emplace_back(_Beg + start, instring.size() - start);
+}
+
+inline void splitLineOnTabs(std::string_view line, std::vector<std::string_view>& tokens, const size_t& sizehint) {
+	splitLineOnChar(line, '\t', tokens, sizehint);
+}
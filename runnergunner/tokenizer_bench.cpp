@@ -0,0 +1,85 @@
+// tokenizer_bench.cpp : Microbenchmark of the tokenizer against the byte-at-a-time splitter.
+//
+// Usage: runnergunner_tokenizer_bench [quant.sf] [repeats]
+// Without a file, synthetic lines with the shape of Salmon quant.sf rows are used.
+
+#include "tokenizer.h"
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+
+static std::string _syntheticQuantFile(size_t lines) {
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<double> tpm(0.0, 500.0);
+	std::uniform_int_distribution<int> len(300, 8000);
+	std::ostringstream out;
+	out << "Name\tLength\tEffectiveLength\tTPM\tNumReads\n";
+	for (size_t i = 0; i < lines; ++i) {
+		const int length = len(rng);
+		const double t = (i % 3) ? tpm(rng) : 0.0; // roughly a third of transcripts are unexpressed
+		out << "AT" << (1 + i % 5) << 'G' << (10000 + i) << '.' << (1 + i % 4) << '\t' << length << '\t'
+			<< (length - 149.5) << '\t' << t << '\t' << (t * 3.1) << '\n';
+	}
+	return out.str();
+}
+
+static volatile size_t _benchSink; // keeps the measured work from being optimized away
+
+template <typename Fn>
+static double _timeMBps(const std::string& data, int repeats, Fn&& fn) {
+	size_t checksum = 0;
+	const auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < repeats; ++r) checksum += fn();
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	_benchSink = checksum;
+	return (double)data.size() * repeats / elapsed.count() / 1048576.0;
+}
+
+static size_t _splitLines(const std::string& data, void (*split)(std::string_view, const char, std::vector<std::string_view>&, const size_t&)) {
+	std::vector<std::string_view> tokens;
+	size_t fields = 0;
+	std::string_view rest(data);
+	while (!rest.empty()) {
+		size_t eol = rest.find('\n');
+		if (eol == std::string_view::npos) eol = rest.size();
+		split(rest.substr(0, eol), '\t', tokens, 5);
+		fields += tokens.size();
+		rest.remove_prefix(eol == rest.size() ? eol : eol + 1);
+	}
+	return fields;
+}
+
+int main(int argc, char* argv[]) {
+	std::string data;
+	if (argc > 1) {
+		std::ifstream in(argv[1], std::ios::binary);
+		if (!in.good()) {
+			std::cerr << "Could not open " << argv[1] << "\n";
+			return 1;
+		}
+		std::ostringstream ss;
+		ss << in.rdbuf();
+		data = ss.str();
+	}
+	else {
+		data = _syntheticQuantFile(200000);
+	}
+	const int repeats = (argc > 2) ? std::stoi(argv[2]) : 20;
+	std::cout << "Tokenizing " << data.size() / 1048576.0 << " MB, " << repeats << " times\n";
+
+	const SimdLevel best = simdLevel();
+	const SimdLevel levels[] = { SimdLevel::scalar, SimdLevel::sse2 };
+	const char* names[] = { "scalar", "sse2" };
+
+	std::cout << "splitLineOnCharScalar (byte loop)\t" << _timeMBps(data, repeats, [&] { return _splitLines(data, splitLineOnCharScalar); }) << " MB/s\n";
+	for (int l = 0; l < 2; ++l) {
+		if (levels[l] > best) break;
+		simdLevel() = levels[l];
+		std::cout << "splitLineOnChar (" << names[l] << ")\t\t" << _timeMBps(data, repeats, [&] { return _splitLines(data, splitLineOnChar); }) << " MB/s\n";
+	}
+	simdLevel() = best;
+	return 0;
+}
@@ -0,0 +1,73 @@
+// tx2gene.h : Transcript to gene mapping for gene-level aggregation.
+//
+// The table has one transcript per line, followed by its gene, separated by a tab or a comma (as written by
+// tximport and most annotation tools); further fields are ignored. All names live in one buffer, and the map
+// holds views into it, so even a table of a few hundred thousand transcripts stays compact.
+
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class Tx2Gene {
+public:
+	static constexpr uint32_t unmapped = UINT32_MAX;
+
+	// Loads the table; on failure returns false and leaves the reason in error. A header line, if any, just maps a
+	// transcript name that never occurs.
+	bool load(const std::filesystem::path& path, std::string& error) {
+		std::ifstream in(path, std::ios::binary);
+		if (!in.good()) {
+			error = "failed to open";
+			return false;
+		}
+		std::ostringstream contents;
+		contents << in.rdbuf();
+		text = contents.str();
+
+		std::unordered_map<std::string_view, uint32_t> geneIndex;
+		std::string_view rest(text);
+		size_t lineNumber = 0;
+		while (!rest.empty()) {
+			const size_t eol = std::min(rest.find('\n'), rest.size());
+			std::string_view line = rest.substr(0, eol);
+			rest.remove_prefix(std::min(eol + 1, rest.size()));
+			++lineNumber;
+			if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+			if (line.empty()) continue;
+			const size_t sep = line.find_first_of("\t,");
+			if (sep == std::string_view::npos) {
+				error = "line " + std::to_string(lineNumber) + " has no gene";
+				return false;
+			}
+			const std::string_view transcript = line.substr(0, sep);
+			std::string_view gene = line.substr(sep + 1);
+			gene = gene.substr(0, std::min(gene.find_first_of("\t,"), gene.size()));
+			const auto added = geneIndex.emplace(gene, (uint32_t)genes.size());
+			if (added.second) genes.push_back(gene);
+			transcripts.emplace(transcript, added.first->second); // the first mapping of a transcript wins
+		}
+		if (transcripts.empty()) {
+			error = "no transcripts";
+			return false;
+		}
+		return true;
+	}
+
+	// Index into genes of the transcript's gene, or unmapped
+	uint32_t find(std::string_view transcript) const {
+		const auto it = transcripts.find(transcript);
+		return (it == transcripts.end()) ? unmapped : it->second;
+	}
+
+	std::vector<std::string_view> genes;
+
+private:
+	std::string text;
+	std::unordered_map<std::string_view, uint32_t> transcripts;
+};